@@ -0,0 +1,390 @@
+// End-to-end ingest benchmark. Generates a synthetic PM file set (or takes
+// an existing folder), times parsing, dedupe and the database insert each on
+// its own and then the whole ingestFiles() path, and prints one JSON
+// document with records/s, MB/s, peak RSS and heap allocations per stage so
+// runs can be compared across commits (see --baseline).
+#include "pm_generator.h"
+#include "../src/db_writer.h"
+#include "../src/ingest.h"
+#include "../src/metrics.h"
+#include "../src/record_batch.h"
+#include "../src/xml_parser.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+// Every C++ heap allocation of the process goes through these, so a stage's
+// count is the difference of two snapshots around it. SQLite allocates with
+// malloc() and is not included.
+static std::atomic<uint64_t> g_allocs{0}, g_allocBytes{0};
+
+void* operator new(std::size_t n) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_allocBytes.fetch_add(n, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t n) {
+    return operator new(n);
+}
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(n);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](std::size_t n, const std::nothrow_t& tag) noexcept {
+    return operator new(n, tag);
+}
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+// Lets the next peakRssKb() cover only what runs after this call. Only Linux
+// can reset the high-water mark; elsewhere the peak is process-wide.
+static void resetPeakRss() {
+#ifdef __linux__
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+static uint64_t peakRssKb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return pmc.PeakWorkingSetSize / 1024;
+    return 0;
+#else
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0) return std::stoull(line.substr(6));
+#endif
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return static_cast<uint64_t>(ru.ru_maxrss) / 1024;
+#else
+    return static_cast<uint64_t>(ru.ru_maxrss);
+#endif
+#endif
+}
+
+struct BenchStage {
+    std::string name;
+    double seconds = 0.0;
+    uint64_t records = 0;   // records the stage processed
+    uint64_t bytes = 0;     // input file bytes those records came from
+    uint64_t peakRssKb = 0; // of the run the stage belongs to
+    uint64_t allocs = 0, allocBytes = 0;
+
+    double recordsPerSecond() const { return seconds > 0 ? records / seconds : 0.0; }
+    double mbPerSecond() const { return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0; }
+};
+
+// Runs `fn` and adds its wall time and allocations to `stage`.
+template <class Fn>
+static bool timed(BenchStage& stage, Fn&& fn) {
+    const uint64_t allocs = g_allocs.load(std::memory_order_relaxed);
+    const uint64_t allocBytes = g_allocBytes.load(std::memory_order_relaxed);
+    const auto t0 = Clock::now();
+    const bool ok = fn();
+    stage.seconds += std::chrono::duration<double>(Clock::now() - t0).count();
+    stage.allocs += g_allocs.load(std::memory_order_relaxed) - allocs;
+    stage.allocBytes += g_allocBytes.load(std::memory_order_relaxed) - allocBytes;
+    return ok;
+}
+
+// The ingest code reports progress on std::cout; keep it out of the output.
+class QuietCout {
+public:
+    QuietCout() : old_(std::cout.rdbuf(nullptr)) {}
+    ~QuietCout() { std::cout.rdbuf(old_); }
+
+private:
+    std::streambuf* old_;
+};
+
+static void removeDb(const fs::path& db) {
+    std::error_code ec;
+    fs::remove(db, ec);
+    fs::remove(db.string() + "-wal", ec);
+    fs::remove(db.string() + "-shm", ec);
+}
+
+// The serial loop of ingestFiles() with each stage timed separately:
+// parse into a reused batch, dedupe it, insert it. DbWriter::write dedupes
+// again; on an already unique batch that is one hash probe per record and
+// stays in the insert figure, as do the final commit and close.
+static bool runStages(const std::vector<std::string>& files, const fs::path& dbPath, const DbOptions& dbOpts,
+                      BenchStage& parse, BenchStage& dedupe, BenchStage& insert) {
+    QuietCout quiet;
+    resetPeakRss();
+    DbWriter db(dbOpts);
+    if (!db.open(dbPath.string())) return false;
+    RecordBatch batch;
+    for (const auto& file : files) {
+        batch.clear();
+        ParseInfo info;
+        if (!timed(parse, [&] { return parse_ericsson_pm_xml(file, batch, &info); })) {
+            std::cerr << "Ошибка разбора " << file << "\n";
+            return false;
+        }
+        parse.records += batch.records.size();
+        parse.bytes += info.bytes;
+
+        dedupe.records += batch.records.size();
+        dedupe.bytes += info.bytes;
+        timed(dedupe, [&] {
+            batch.dedupe();
+            return true;
+        });
+
+        insert.records += batch.records.size();
+        insert.bytes += info.bytes;
+        if (!timed(insert, [&] { return db.write(batch); })) {
+            std::cerr << "Ошибка записи в БД: " << file << "\n";
+            return false;
+        }
+    }
+    const bool ok = timed(insert, [&] {
+        const bool flushed = db.flush();
+        db.close();
+        return flushed;
+    });
+    parse.peakRssKb = dedupe.peakRssKb = insert.peakRssKb = peakRssKb();
+    return ok;
+}
+
+// What eniq does for a folder: ingestFiles() with `jobs` parser threads into
+// a fresh database, manifest included.
+static bool runEndToEnd(const std::vector<std::string>& files, const fs::path& dbPath, const DbOptions& dbOpts,
+                        unsigned jobs, BenchStage& total) {
+    QuietCout quiet;
+    resetPeakRss();
+    const bool ok = timed(total, [&] {
+        DbWriter db(dbOpts);
+        IngestOptions opts;
+        opts.jobs = jobs;
+        return db.open(dbPath.string()) && ingestFiles(files, db, opts) && db.flush();
+    });
+    total.peakRssKb = peakRssKb();
+    return ok;
+}
+
+static std::string jsonString(const std::string& s) {
+    return "\"" + jsonEscape(s) + "\"";
+}
+
+// One stage per line, so --baseline can read the file back without a JSON
+// parser.
+static std::string stageJson(const BenchStage& s) {
+    std::ostringstream out;
+    out << std::fixed << "{\"name\": " << jsonString(s.name) << ", \"seconds\": " << std::setprecision(6) << s.seconds
+        << ", \"records\": " << s.records << ", \"bytes\": " << s.bytes << ", \"records_per_s\": "
+        << std::setprecision(1) << s.recordsPerSecond() << ", \"mb_per_s\": " << std::setprecision(3)
+        << s.mbPerSecond() << ", \"peak_rss_kb\": " << s.peakRssKb << ", \"allocs\": " << s.allocs
+        << ", \"alloc_bytes\": " << s.allocBytes << "}";
+    return out.str();
+}
+
+// records_per_s of `stage` in a file written by stageJson(); 0 if absent.
+static double baselineRate(const std::string& path, const std::string& stage) {
+    std::ifstream in(path);
+    std::string line;
+    const std::string name = "\"name\": " + jsonString(stage) + ",";
+    const std::string key = "\"records_per_s\": ";
+    while (std::getline(in, line)) {
+        if (line.find(name) == std::string::npos) continue;
+        size_t pos = line.find(key);
+        if (pos != std::string::npos) return std::atof(line.c_str() + pos + key.size());
+    }
+    return 0.0;
+}
+
+static void usage() {
+    std::cout << "Использование: bench_ingest [опции]\n"
+                 "  --input DIR      мерить на файлах из DIR вместо сгенерированных\n"
+                 "  --jobs N         потоков разбора для end_to_end (0 = по числу ядер, по умолчанию 1)\n"
+                 "  --schema S       flat или normalized\n"
+                 "  --rollups        с агрегатами и индексом\n"
+                 "  --work DIR       папка для файлов и БД (по умолчанию во временной папке)\n"
+                 "  --keep           не удалять сгенерированные файлы и БД\n"
+                 "  --label S        метка прогона в JSON (например, хеш коммита)\n"
+                 "  --json PATH      записать JSON в PATH вместо stdout\n"
+                 "  --baseline PATH  сравнить зап/с по стадиям с прошлым JSON\n"
+                 "Параметры генератора (см. pm_gen): --files --meas-infos --mos --counters --dup-ratio\n"
+                 "  --nodes --start --rop-minutes --seed\n";
+}
+
+int main(int argc, char* argv[]) {
+    PmGenOptions gen;
+    DbOptions dbOpts;
+    unsigned jobs = 1;
+    std::string input, work, label, jsonPath, baseline;
+    bool keep = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        bool bad = false;
+        if (parseGenOption(argc, argv, i, gen, bad)) {
+            if (!bad) continue;
+        } else if (arg == "--input" && hasValue) {
+            input = argv[++i];
+            continue;
+        } else if ((arg == "--jobs" || arg == "-j") && hasValue) {
+            const char* v = argv[++i];
+            auto res = std::from_chars(v, v + std::strlen(v), jobs);
+            if (res.ec == std::errc() && *res.ptr == '\0') {
+                if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+                continue;
+            }
+        } else if (arg == "--schema" && hasValue) {
+            std::string schema = argv[++i];
+            if (schema == "flat" || schema == "normalized") {
+                dbOpts.schema = schema == "flat" ? DbSchema::Flat : DbSchema::Normalized;
+                continue;
+            }
+        } else if (arg == "--rollups") {
+            dbOpts.rollups = true;
+            continue;
+        } else if (arg == "--work" && hasValue) {
+            work = argv[++i];
+            continue;
+        } else if (arg == "--keep") {
+            keep = true;
+            continue;
+        } else if (arg == "--label" && hasValue) {
+            label = argv[++i];
+            continue;
+        } else if (arg == "--json" && hasValue) {
+            jsonPath = argv[++i];
+            continue;
+        } else if (arg == "--baseline" && hasValue) {
+            baseline = argv[++i];
+            continue;
+        }
+        usage();
+        return 1;
+    }
+
+    fs::path workDir = work.empty() ? fs::temp_directory_path() /
+                                          ("eniq_bench_" + std::to_string(Clock::now().time_since_epoch().count()))
+                                    : fs::path(work);
+    std::error_code ec;
+    fs::create_directories(workDir, ec);
+    const fs::path pmDir = workDir / "pm";
+    const fs::path dbPath = workDir / "bench.db";
+    removeDb(dbPath);
+
+    std::vector<std::string> files;
+    PmGenStats genStats;
+    double genSeconds = 0.0;
+    if (input.empty()) {
+        const auto t0 = Clock::now();
+        files = generatePmFiles(pmDir.string(), gen, genStats);
+        genSeconds = std::chrono::duration<double>(Clock::now() - t0).count();
+    } else {
+        files = listPmFiles(input);
+        std::sort(files.begin(), files.end());
+    }
+    if (files.empty()) {
+        std::cerr << "Нет файлов для замера\n";
+        return 1;
+    }
+    uint64_t bytes = 0;
+    for (const auto& f : files) bytes += fs::file_size(f, ec);
+
+    BenchStage parse{"parse"}, dedupe{"dedupe"}, insert{"insert"}, total{"end_to_end"};
+    bool ok = runStages(files, dbPath, dbOpts, parse, dedupe, insert);
+    removeDb(dbPath);
+    ok = ok && runEndToEnd(files, dbPath, dbOpts, jobs, total);
+    total.records = parse.records;
+    total.bytes = bytes;
+    if (!keep) {
+        removeDb(dbPath);
+        if (input.empty()) fs::remove_all(pmDir, ec);
+        fs::remove(workDir, ec); // only if now empty
+    }
+    if (!ok) return 1;
+
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"label\": " << jsonString(label) << ",\n"
+         << "  \"schema\": \"" << (dbOpts.schema == DbSchema::Flat ? "flat" : "normalized") << "\",\n"
+         << "  \"rollups\": " << (dbOpts.rollups ? "true" : "false") << ",\n"
+         << "  \"jobs\": " << jobs << ",\n"
+         << "  \"input\": {\"files\": " << files.size() << ", \"bytes\": " << bytes
+         << ", \"records\": " << parse.records << ", \"duplicates\": " << parse.records - insert.records
+         << ", \"source\": " << jsonString(input.empty() ? "generated" : input) << "},\n";
+    if (input.empty())
+        json << "  \"generator\": {\"files\": " << gen.files << ", \"meas_infos\": " << gen.measInfos
+             << ", \"mos\": " << gen.mos << ", \"counters\": " << gen.counters << ", \"dup_ratio\": " << gen.dupRatio
+             << ", \"nodes\": " << gen.nodes << ", \"seed\": " << gen.seed << ", \"seconds\": " << genSeconds
+             << "},\n";
+    json << "  \"stages\": [\n";
+    const BenchStage* stages[] = {&parse, &dedupe, &insert, &total};
+    for (size_t i = 0; i < 4; ++i) json << "    " << stageJson(*stages[i]) << (i + 1 < 4 ? ",\n" : "\n");
+    json << "  ]\n}\n";
+
+    if (jsonPath.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream out(jsonPath, std::ios::binary | std::ios::trunc);
+        if (!(out << json.str())) {
+            std::cerr << "Не удалось записать " << jsonPath << "\n";
+            return 1;
+        }
+    }
+
+    std::cerr << files.size() << " файлов, " << bytes / (1024.0 * 1024.0) << " МБ, " << parse.records
+              << " записей\n";
+    for (const BenchStage* s : stages) {
+        std::cerr << std::left << std::setw(11) << s->name << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(9) << s->seconds << " с" << std::setprecision(0) << std::setw(12)
+                  << s->recordsPerSecond() << " зап/с" << std::setprecision(1) << std::setw(9) << s->mbPerSecond()
+                  << " МБ/с" << std::setw(10) << s->peakRssKb / 1024 << " МБ RSS" << std::setw(12) << s->allocs
+                  << " выделений";
+        if (!baseline.empty()) {
+            double before = baselineRate(baseline, s->name);
+            if (before > 0) std::cerr << std::showpos << std::setw(8) << (s->recordsPerSecond() / before - 1) * 100
+                                      << std::noshowpos << "%";
+        }
+        std::cerr << "\n";
+    }
+    return 0;
+}
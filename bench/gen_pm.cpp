@@ -0,0 +1,43 @@
+// Writes a set of synthetic PM files for benchmarks and load tests.
+#include "pm_generator.h"
+#include <iostream>
+#include <string>
+
+static void usage() {
+    std::cout << "Использование: pm_gen [опции] <папка>\n"
+                 "  --files N        число файлов (по умолчанию 8)\n"
+                 "  --meas-infos N   блоков measInfo в файле (по умолчанию 4)\n"
+                 "  --mos N          measValue (MO) в каждом measInfo (по умолчанию 250)\n"
+                 "  --counters N     счётчиков в measTypes (по умолчанию 25)\n"
+                 "  --dup-ratio X    доля measValue, повторённых в файле, 0..1 (по умолчанию 0)\n"
+                 "  --nodes N        число узлов; файлы сверх него идут в следующие ROP (0 = по файлу на узел)\n"
+                 "  --start T        начало первого ROP, ISO 8601 (по умолчанию 2026-01-01T00:00:00Z)\n"
+                 "  --rop-minutes N  длина ROP в минутах (по умолчанию 15)\n"
+                 "  --seed N         зерно генератора значений (по умолчанию 1)\n";
+}
+
+int main(int argc, char* argv[]) {
+    PmGenOptions opts;
+    std::string dir;
+    for (int i = 1; i < argc; ++i) {
+        bool bad = false;
+        if (parseGenOption(argc, argv, i, opts, bad)) {
+            if (!bad) continue;
+        } else if (argv[i][0] != '-' && dir.empty()) {
+            dir = argv[i];
+            continue;
+        }
+        usage();
+        return 1;
+    }
+    if (dir.empty()) {
+        usage();
+        return 1;
+    }
+
+    PmGenStats stats;
+    if (generatePmFiles(dir, opts, stats).empty() && opts.files) return 1;
+    std::cout << "Создано " << stats.files << " файлов, " << stats.records << " записей (" << stats.duplicates
+              << " повторов), " << stats.bytes / (1024.0 * 1024.0) << " МБ в " << dir << "\n";
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "pm_generator.h"
+#include "../src/pm_time.h"
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Pieces of real counter and MO class names, combined so sets look like
+// production files (long shared prefixes, a few dozen distinct names).
+const char* kCounterStems[] = {"pmRrcConnEstab", "pmErabEstab", "pmPdcpVolDl", "pmPdcpVolUl", "pmMacHarqDl",
+                               "pmRadioThpVol",  "pmHoPrepAtt", "pmHoExe",     "pmPrbUsedDl", "pmUeCtxtRel"};
+const char* kCounterSuffixes[] = {"Att", "Succ", "Fail", "Sum", "Samp", "Max", "Drb", "Qci"};
+const char* kMoClasses[] = {"EUtranCellFDD", "EUtranFreqRelation", "EUtranCellRelation", "UtranCellRelation",
+                            "GeranCellRelation", "SectorCarrier", "PmUeMeasControl", "RadioBearer"};
+
+std::string counterName(size_t info, size_t k) {
+    const size_t stems = sizeof(kCounterStems) / sizeof(kCounterStems[0]);
+    const size_t suffixes = sizeof(kCounterSuffixes) / sizeof(kCounterSuffixes[0]);
+    std::string name = kCounterStems[(info + k / suffixes) % stems];
+    name += kCounterSuffixes[k % suffixes];
+    if (k >= stems * suffixes) name += std::to_string(k / (stems * suffixes));
+    return name;
+}
+
+std::string moClass(size_t info) {
+    const size_t n = sizeof(kMoClasses) / sizeof(kMoClasses[0]);
+    std::string c = kMoClasses[info % n];
+    if (info >= n) c += std::to_string(info / n);
+    return c;
+}
+
+std::string nodeName(size_t node) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "ERBS%05zu", node + 1);
+    return buf;
+}
+
+// "A20260101.0000+0000-0015_ERBS00001_statsfile.xml"
+std::string fileName(int64_t begin, int64_t end, const std::string& node) {
+    const std::string b = formatPmTimestamp(begin), e = formatPmTimestamp(end);
+    return "A" + b.substr(0, 4) + b.substr(5, 2) + b.substr(8, 2) + "." + b.substr(11, 2) + b.substr(14, 2) +
+           "+0000-" + e.substr(11, 2) + e.substr(14, 2) + "_" + node + "_statsfile.xml";
+}
+
+size_t nodeCount(const PmGenOptions& opts) {
+    return opts.nodes ? opts.nodes : (opts.files ? opts.files : 1);
+}
+
+int64_t ropBegin(const PmGenOptions& opts, size_t index) {
+    return opts.start + static_cast<int64_t>(index / nodeCount(opts)) * opts.ropMinutes * 60;
+}
+
+// The whole of `s` as a T, like parseNumber in main.cpp: no sign for
+// unsigned types, no trailing characters, no value out of T's range.
+template <typename T>
+bool parseWhole(const char* s, T& out) {
+    const char* end = s + std::strlen(s);
+    auto res = std::from_chars(s, end, out);
+    return res.ec == std::errc() && res.ptr == end;
+}
+
+} // namespace
+
+bool writePmFile(const std::string& path, const PmGenOptions& opts, size_t index, PmGenStats& stats) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Не удалось создать " << path << "\n";
+        return false;
+    }
+
+    std::mt19937 rng(opts.seed * 2654435761u + static_cast<uint32_t>(index));
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::uniform_int_distribution<int> counts(0, 100000);
+
+    const std::string node = nodeName(index % nodeCount(opts));
+    const int64_t begin = ropBegin(opts, index);
+    const std::string beginTime = formatPmTimestamp(begin);
+    const std::string endTime = formatPmTimestamp(begin + opts.ropMinutes * 60);
+    const std::string dn = "SubNetwork=ONRM_ROOT_MO,SubNetwork=LTE,MeContext=" + node;
+
+    std::string buf;
+    buf.reserve(1 << 20);
+    buf += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<measCollecFile xmlns=\"http://www.3gpp.org/ftp/specs/archive/32_series/32.435#measCollec\">\n"
+           "  <fileHeader fileFormatVersion=\"32.435 V10.0\" vendorName=\"Ericsson AB\">\n"
+           "    <fileSender localDn=\"" + dn + "\"/>\n"
+           "    <measCollec beginTime=\"" + beginTime + "\"/>\n"
+           "  </fileHeader>\n"
+           "  <measData>\n"
+           "    <managedElement localDn=\"" + dn + "\"/>\n";
+
+    char value[32];
+    uint64_t bytes = 0;
+    for (size_t info = 0; info < opts.measInfos; ++info) {
+        const std::string cls = moClass(info);
+        buf += "    <measInfo measInfoId=\"PM=1,PmGroup=" + cls + "\">\n"
+               "      <job jobId=\"" + std::to_string(info + 1) + "\"/>\n"
+               "      <granPeriod duration=\"PT" + std::to_string(opts.ropMinutes * 60) + "S\" endTime=\"" + endTime +
+               "\"/>\n"
+               "      <measTypes>";
+        for (size_t k = 0; k < opts.counters; ++k) {
+            if (k) buf += ' ';
+            buf += counterName(info, k);
+        }
+        buf += "</measTypes>\n";
+
+        for (size_t mo = 0; mo < opts.mos; ++mo) {
+            const size_t start = buf.size();
+            buf += "      <measValue>\n        <measObjLdn>" + dn + ",ManagedElement=1,ENodeBFunction=1," + cls + "=" +
+                   node + "-" + std::to_string(mo + 1) + "</measObjLdn>\n        ";
+            for (size_t k = 0; k < opts.counters; ++k) {
+                // Mostly counts, some gauges with decimals, a few zeros.
+                const double u = unit(rng);
+                if (u < 0.1) std::snprintf(value, sizeof(value), "0");
+                else if (u < 0.3) std::snprintf(value, sizeof(value), "%.2f", counts(rng) / 100.0);
+                else std::snprintf(value, sizeof(value), "%d", counts(rng));
+                buf += "<r>";
+                buf += value;
+                buf += "</r>";
+            }
+            buf += "\n      </measValue>\n";
+            stats.records += opts.counters;
+
+            // A re-sent block: same MO and values, as seen after collector retries.
+            if (opts.dupRatio > 0.0 && unit(rng) < opts.dupRatio) {
+                buf.append(buf, start, buf.size() - start);
+                stats.records += opts.counters;
+                stats.duplicates += opts.counters;
+            }
+            if (buf.size() >= (1 << 20)) {
+                out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+                bytes += buf.size();
+                buf.clear();
+            }
+        }
+        buf += "    </measInfo>\n";
+    }
+    buf += "  </measData>\n"
+           "  <fileFooter>\n"
+           "    <measCollec endTime=\"" + endTime + "\"/>\n"
+           "  </fileFooter>\n"
+           "</measCollecFile>\n";
+    out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+    bytes += buf.size();
+    if (!out.flush()) {
+        std::cerr << "Ошибка записи " << path << "\n";
+        return false;
+    }
+    stats.bytes += bytes;
+    ++stats.files;
+    return true;
+}
+
+std::vector<std::string> generatePmFiles(const std::string& dir, const PmGenOptions& opts, PmGenStats& stats) {
+    std::vector<std::string> paths;
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        std::cerr << "Не удалось создать папку " << dir << ": " << ec.message() << "\n";
+        return paths;
+    }
+    for (size_t i = 0; i < opts.files; ++i) {
+        const int64_t begin = ropBegin(opts, i);
+        const std::string name = fileName(begin, begin + opts.ropMinutes * 60, nodeName(i % nodeCount(opts)));
+        const std::string path = (fs::path(dir) / name).string();
+        if (!writePmFile(path, opts, i, stats)) return {};
+        paths.push_back(path);
+    }
+    return paths;
+}
+
+bool parseGenOption(int argc, char* argv[], int& i, PmGenOptions& opts, bool& bad) {
+    const std::string arg = argv[i];
+    if (arg != "--files" && arg != "--meas-infos" && arg != "--mos" && arg != "--counters" && arg != "--dup-ratio" &&
+        arg != "--nodes" && arg != "--start" && arg != "--rop-minutes" && arg != "--seed")
+        return false;
+    if (i + 1 >= argc) {
+        bad = true;
+        return true;
+    }
+    const char* value = argv[++i];
+    if (arg == "--files") bad = !parseWhole(value, opts.files);
+    else if (arg == "--meas-infos") bad = !parseWhole(value, opts.measInfos);
+    else if (arg == "--mos") bad = !parseWhole(value, opts.mos);
+    else if (arg == "--counters") bad = !parseWhole(value, opts.counters);
+    else if (arg == "--dup-ratio") bad = !parseWhole(value, opts.dupRatio);
+    else if (arg == "--nodes") bad = !parseWhole(value, opts.nodes);
+    else if (arg == "--start") bad = !parsePmTimestamp(value, opts.start);
+    else if (arg == "--rop-minutes") bad = !parseWhole(value, opts.ropMinutes);
+    else if (arg == "--seed") bad = !parseWhole(value, opts.seed);
+    // Written as a negated range so NaN from "nan" is refused too.
+    if (!(opts.dupRatio >= 0.0 && opts.dupRatio <= 1.0) || opts.ropMinutes <= 0) bad = true;
+    return true;
+}
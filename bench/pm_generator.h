@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Synthetic Ericsson PM files in the layout parse_ericsson_pm_xml() reads:
+// fileHeader/measCollec beginTime, measInfo blocks with a measTypes list and
+// measValue elements holding measObjLdn and one <r> per counter.
+struct PmGenOptions {
+    size_t files = 8;
+    size_t measInfos = 4;     // measInfo blocks per file
+    size_t mos = 250;         // measValue blocks per measInfo
+    size_t counters = 25;     // counter names per measTypes
+    double dupRatio = 0.0;    // share of measValue blocks sent twice in a file
+    size_t nodes = 0;         // distinct MeContexts; 0 = one per file, all in one ROP
+    int64_t start = 1767225600; // first ROP, 2026-01-01T00:00:00Z
+    int ropMinutes = 15;
+    uint32_t seed = 1;
+};
+
+struct PmGenStats {
+    size_t files = 0;
+    uint64_t records = 0;    // <r> values written, repeats included
+    uint64_t duplicates = 0; // of which repeats of an earlier measValue
+    uint64_t bytes = 0;
+};
+
+// Writes file `index` of the set described by `opts` to `path`. File i
+// belongs to node i % nodes and ROP i / nodes, so a set with fewer nodes
+// than files spans several ROPs. Output only depends on opts and index.
+bool writePmFile(const std::string& path, const PmGenOptions& opts, size_t index, PmGenStats& stats);
+
+// Writes the whole set into `dir` (created if missing) under Ericsson-style
+// names and returns their paths; empty on failure.
+std::vector<std::string> generatePmFiles(const std::string& dir, const PmGenOptions& opts, PmGenStats& stats);
+
+// Command line shared by pm_gen and bench_ingest: consumes the generator
+// option at argv[i] and its value. Returns false if argv[i] is not one;
+// sets `bad` if the value is missing or malformed.
+bool parseGenOption(int argc, char* argv[], int& i, PmGenOptions& opts, bool& bad);
@@ -1,108 +1,787 @@
 #include "db_writer.h"
+#include "metrics.h"
+#include "pm_sql.h"
+#include "pm_time.h"
 #include <sqlite3.h>
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <initializer_list>
 #include <iostream>
-#include <unordered_set>
 #include <string>
 
-static int callback(void* NotUsed, int argc, char** argv, char** azColName) {
-    return 0;
+namespace {
+
+const char* kFlatSchema =
+    "CREATE TABLE IF NOT EXISTS pm_counters ("
+    "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "  timestamp TEXT NOT NULL,"
+    "  mo_ldn TEXT NOT NULL,"
+    "  meas_type TEXT,"
+    "  counter_name TEXT NOT NULL,"
+    "  value REAL"
+    ");"
+    // Ensure uniqueness to prevent duplicates: (timestamp, mo_ldn, meas_type, counter_name)
+    "CREATE UNIQUE INDEX IF NOT EXISTS idx_unique_pm ON pm_counters (timestamp, mo_ldn, meas_type, counter_name);";
+
+// The fact primary key doubles as the uniqueness check, and WITHOUT ROWID
+// stores each row once, inside that key's b-tree.
+const char* kNormalizedSchema =
+    "CREATE TABLE IF NOT EXISTS pm_mo (id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+    "CREATE TABLE IF NOT EXISTS pm_meas_type (id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+    "CREATE TABLE IF NOT EXISTS pm_counter (id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+    "CREATE TABLE IF NOT EXISTS pm_value ("
+    "  ts INTEGER NOT NULL,"
+    "  mo_id INTEGER NOT NULL,"
+    "  meas_type_id INTEGER NOT NULL,"
+    "  counter_id INTEGER NOT NULL,"
+    "  value REAL,"
+    "  PRIMARY KEY (ts, mo_id, meas_type_id, counter_id)"
+    ") WITHOUT ROWID;"
+    // Not byte-identical to the flat table: timestamps come back in UTC as
+    // "...Z" (the source offset text is not kept) and there is no id column.
+    "CREATE VIEW IF NOT EXISTS pm_counters AS"
+    "  SELECT strftime('%Y-%m-%dT%H:%M:%SZ', v.ts, 'unixepoch') AS timestamp,"
+    "         m.name AS mo_ldn, t.name AS meas_type, c.name AS counter_name, v.value AS value"
+    "  FROM pm_value v"
+    "  JOIN pm_mo m ON m.id = v.mo_id"
+    "  JOIN pm_meas_type t ON t.id = v.meas_type_id"
+    "  JOIN pm_counter c ON c.id = v.counter_id;";
+
+// Files already loaded, so unchanged ones are skipped before parsing.
+const char* kManifestSchema =
+    "CREATE TABLE IF NOT EXISTS ingest_manifest ("
+    "  path TEXT PRIMARY KEY,"
+    "  size INTEGER NOT NULL,"
+    "  mtime INTEGER NOT NULL,"
+    "  hash INTEGER NOT NULL,"
+    "  records INTEGER NOT NULL,"
+    "  ingested_at INTEGER NOT NULL"
+    ") WITHOUT ROWID;";
+
+const char* kColumns[] = {
+    "(timestamp, mo_ldn, meas_type, counter_name, value)",
+    "(ts, mo_id, meas_type_id, counter_id, value)",
+};
+
+// Rollup tables: count/sum/min/max per hour or day, MO, measurement type
+// and counter. The key leads with the counter, which every query names.
+const char* kRollupKeys[] = {"mo_ldn, meas_type, counter_name", "mo_id, meas_type_id, counter_id"};
+const char* kRollupPrimaryKey[] = {"counter_name, mo_ldn, meas_type, bucket", "counter_id, mo_id, meas_type_id, bucket"};
+
+// Counter + MO lookups over raw facts. Only the normalized one covers the
+// query: its integer columns are cheap to copy, whereas a covering flat index
+// would repeat every text column and about double the file.
+const char* kCounterIndex[] = {
+    "CREATE INDEX IF NOT EXISTS idx_pm_counter ON pm_counters (counter_name, mo_ldn, timestamp);",
+    "CREATE INDEX IF NOT EXISTS idx_pm_value_counter ON pm_value (counter_id, mo_id, ts, meas_type_id, value);",
+};
+
+// Facts as (t, key columns, value) with t in epoch seconds, for the
+// one-time rollup build. pm_epoch() is parsePmTimestamp(), as used for the
+// rollups of every later write.
+const char* kRollupSource[] = {
+    "(SELECT pm_epoch(timestamp) AS t, mo_ldn, coalesce(meas_type, '') AS meas_type,"
+    " counter_name, value FROM pm_counters)",
+    "(SELECT ts AS t, mo_id, meas_type_id, counter_id, value FROM pm_value)",
+};
+
+const int64_t kHour = 3600, kDay = 86400;
+
+// Timestamps use INT64_MIN for "not parsed yet" and INT64_MIN + 1 for
+// "not a valid timestamp".
+const int64_t kUnparsed = INT64_MIN, kInvalid = INT64_MIN + 1;
+
+int64_t floorTo(int64_t t, int64_t width) {
+    return t - ((t % width) + width) % width;
 }
 
-bool initDatabase(const std::string& dbPath) {
-    sqlite3* db;
-    int rc = sqlite3_open(dbPath.c_str(), &db);
-    if (rc) {
-        std::cerr << "Ошибка открытия БД: " << (db ? sqlite3_errmsg(db) : "(no handle)") << "\n";
-        if (db) sqlite3_close(db);
-        return false;
-    }
+// Same as floorTo() in SQL.
+std::string sqlFloorTo(const std::string& expr, int64_t width) {
+    const std::string w = std::to_string(width);
+    return "(" + expr + " - ((" + expr + " % " + w + ") + " + w + ") % " + w + ")";
+}
 
-    const char* sql =
-        "CREATE TABLE IF NOT EXISTS pm_counters ("
-        "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  timestamp TEXT NOT NULL,"
-        "  mo_ldn TEXT NOT NULL,"
-        "  meas_type TEXT,"
-        "  counter_name TEXT NOT NULL,"
-        "  value REAL"
-        ");";
+std::string rollupTable(const char* table, int k) {
+    std::string sql = std::string("CREATE TABLE IF NOT EXISTS ") + table + " (bucket INTEGER NOT NULL,";
+    sql += k ? " mo_id INTEGER NOT NULL, meas_type_id INTEGER NOT NULL, counter_id INTEGER NOT NULL,"
+             : " mo_ldn TEXT NOT NULL, meas_type TEXT NOT NULL, counter_name TEXT NOT NULL,";
+    sql += " value_count INTEGER NOT NULL, value_sum REAL, value_min REAL, value_max REAL,";
+    sql += std::string(" PRIMARY KEY (") + kRollupPrimaryKey[k] + ")) WITHOUT ROWID;";
+    return sql;
+}
+
+std::string rollupUpsert(const char* table, int k, size_t rows) {
+    std::string values;
+    for (size_t i = 0; i < rows; ++i) values += i ? ",(?,?,?,?,?,?,?,?)" : "(?,?,?,?,?,?,?,?)";
+    return std::string("INSERT INTO ") + table + " (bucket, " + kRollupKeys[k] +
+           ", value_count, value_sum, value_min, value_max) VALUES " + values +
+           " ON CONFLICT (" + kRollupPrimaryKey[k] + ") DO UPDATE SET"
+           " value_count = value_count + excluded.value_count, value_sum = value_sum + excluded.value_sum,"
+           " value_min = min(value_min, excluded.value_min), value_max = max(value_max, excluded.value_max);";
+}
+
+bool oneOf(const std::string& value, std::initializer_list<const char*> allowed) {
+    std::string upper = value;
+    for (char& c : upper) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    return std::find(allowed.begin(), allowed.end(), upper) != allowed.end();
+}
 
+} // namespace
+
+DbWriter::DbWriter(DbOptions opts) : opts_(std::move(opts)) {
+    if (opts_.rowsPerInsert == 0) opts_.rowsPerInsert = 1;
+    // SQLite builds before 3.32 allow at most 999 host parameters.
+    opts_.rowsPerInsert = std::min<size_t>(opts_.rowsPerInsert, 999 / 5);
+    rowsPerUpsert_ = std::min<size_t>(opts_.rowsPerInsert, 999 / 8);
+}
+
+DbWriter::~DbWriter() {
+    close();
+}
+
+bool DbWriter::exec(const char* sql, const char* what) {
     char* errMsg = nullptr;
-    rc = sqlite3_exec(db, sql, callback, 0, &errMsg);
+    int rc = sqlite3_exec(db_, sql, nullptr, nullptr, &errMsg);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL error: " << (errMsg ? errMsg : "") << "\n";
+        std::cerr << what << ": " << (errMsg ? errMsg : sqlite3_errmsg(db_)) << "\n";
         if (errMsg) sqlite3_free(errMsg);
+        return false;
     }
+    return true;
+}
 
-    // Ensure uniqueness to prevent duplicates: (timestamp, mo_ldn, meas_type, counter_name)
-    const char* idx_sql =
-        "CREATE UNIQUE INDEX IF NOT EXISTS idx_unique_pm ON pm_counters (timestamp, mo_ldn, meas_type, counter_name);";
-    rc = sqlite3_exec(db, idx_sql, callback, 0, &errMsg);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL index error: " << (errMsg ? errMsg : "") << "\n";
-        if (errMsg) sqlite3_free(errMsg);
+bool DbWriter::open(const std::string& dbPath) {
+    close();
+
+    if ((!opts_.journalMode.empty() && !isJournalMode(opts_.journalMode)) ||
+        (!opts_.synchronous.empty() && !isSynchronousMode(opts_.synchronous))) {
+        std::cerr << "Недопустимый journal_mode или synchronous: " << opts_.journalMode << ", " << opts_.synchronous
+                  << "\n";
+        return false;
+    }
+
+    int rc = sqlite3_open(dbPath.c_str(), &db_);
+    if (rc) {
+        std::cerr << "Ошибка открытия БД: " << (db_ ? sqlite3_errmsg(db_) : "(no handle)") << "\n";
+        if (db_) sqlite3_close(db_);
+        db_ = nullptr;
+        return false;
+    }
+    sqlite3_busy_timeout(db_, opts_.busyTimeoutMs);
+    if (!registerPmFunctions(db_)) {
+        std::cerr << "Ошибка регистрации функций SQL: " << sqlite3_errmsg(db_) << "\n";
+        close();
+        return false;
     }
 
-    sqlite3_close(db);
+    // page_size has to be set before the first table is created.
+    std::string pragmas;
+    if (opts_.pageSize > 0) pragmas += "PRAGMA page_size=" + std::to_string(opts_.pageSize) + ";";
+    if (!opts_.journalMode.empty()) pragmas += "PRAGMA journal_mode=" + opts_.journalMode + ";";
+    if (!opts_.synchronous.empty()) pragmas += "PRAGMA synchronous=" + opts_.synchronous + ";";
+    pragmas += "PRAGMA cache_size=-" + std::to_string(opts_.cacheSizeKb) + ";";
+    pragmas += "PRAGMA mmap_size=" + std::to_string(opts_.mmapSize) + ";";
+    pragmas += "PRAGMA temp_store=MEMORY;";
+    if (!exec(pragmas.c_str(), "PRAGMA error") || !createSchema()) {
+        close();
+        return false;
+    }
+
+    insertMany_ = prepareInsert(opts_.rowsPerInsert);
+    insertOne_ = opts_.rowsPerInsert == 1 ? insertMany_ : prepareInsert(1);
+    findFile_ = prepare("SELECT size, mtime, hash FROM ingest_manifest WHERE path = ?;");
+    recordFile_ = prepare(
+        "INSERT OR REPLACE INTO ingest_manifest (path, size, mtime, hash, records, ingested_at)"
+        " VALUES (?, ?, ?, ?, ?, CAST(strftime('%s', 'now') AS INTEGER));");
+    touchFile_ = prepare("UPDATE ingest_manifest SET mtime = ? WHERE path = ?;");
+    bool ok = insertMany_ && insertOne_ && findFile_ && recordFile_ && touchFile_;
+    if (ok && (rollups_ || opts_.insertedOnly)) ok = prepareProbe();
+    if (ok && rollups_) ok = prepareUpserts();
+    if (ok && opts_.schema == DbSchema::Normalized) {
+        ok = prepareDimension(mos_, "pm_mo") && prepareDimension(measTypes_, "pm_meas_type") &&
+             prepareDimension(counters_, "pm_counter");
+    }
+    if (!ok) {
+        close();
+        return false;
+    }
     return true;
 }
 
-bool saveRecords(const std::string& dbPath, const std::vector<CounterRecord>& records) {
-    if (records.empty()) return true;
-
-    // In-memory dedupe to reduce DB work
-    std::unordered_set<std::string> seen;
-    std::vector<CounterRecord> filtered;
-    filtered.reserve(records.size());
+bool DbWriter::createSchema() {
+    // A database keeps the schema it was created with; refuse to mix them.
+    sqlite3_stmt* stmt = prepare("SELECT type FROM sqlite_master WHERE name = 'pm_counters';");
+    if (!stmt) return false;
+    std::string existing;
+    if (sqlite3_step(stmt) == SQLITE_ROW) existing = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
 
-    for (const auto& r : records) {
-        std::string key = r.timestamp + "\x1" + r.mo_ldn + "\x1" + r.meas_type + "\x1" + r.counter_name;
-        if (seen.insert(key).second) filtered.push_back(r);
+    const bool normalized = opts_.schema == DbSchema::Normalized;
+    if (existing == (normalized ? "table" : "view")) {
+        std::cerr << "Ошибка схемы: БД создана со схемой " << (normalized ? "flat" : "normalized")
+                  << ", запрошена " << (normalized ? "normalized" : "flat") << "\n";
+        return false;
     }
+    return exec(normalized ? kNormalizedSchema : kFlatSchema, "SQL error") && exec(kManifestSchema, "SQL error") &&
+           createRollups();
+}
 
-    if (filtered.empty()) {
-        std::cout << "Нет новых записей для сохранения\n";
-        return true;
+// Only notices existing rollups, or creates them empty for a database
+// without facts; filling them from loaded data is left to buildRollups().
+bool DbWriter::createRollups() {
+    sqlite3_stmt* stmt = prepare("SELECT 1 FROM sqlite_master WHERE name = 'pm_rollup_hour';");
+    if (!stmt) return false;
+    const bool exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    rollups_ = exists;
+    if (exists || !opts_.rollups) return true;
+
+    stmt = prepare("SELECT 1 FROM pm_counters LIMIT 1;");
+    if (!stmt) return false;
+    const bool hasFacts = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if (hasFacts) {
+        std::cerr << "В БД уже есть данные без агрегатов: постройте их один раз с --build-rollups\n";
+        return false;
     }
+    const int k = opts_.schema == DbSchema::Normalized ? 1 : 0;
+    const std::string sql = rollupTable("pm_rollup_hour", k) + rollupTable("pm_rollup_day", k) + kCounterIndex[k];
+    rollups_ = exec(sql.c_str(), "SQL error");
+    return rollups_;
+}
 
-    sqlite3* db = nullptr;
-    int rc = sqlite3_open(dbPath.c_str(), &db);
-    if (rc) {
-        std::cerr << "Ошибка открытия БД: " << (db ? sqlite3_errmsg(db) : "(no handle)") << "\n";
-        if (db) sqlite3_close(db);
+bool DbWriter::buildRollups() {
+    if (!db_ || !flush()) return false;
+    if (rollups_) return true;
+    std::cout << "Построение агрегатов и индекса по уже загруженным данным...\n";
+
+    // Built once from whatever is already loaded; from here on every
+    // commit keeps them current.
+    const int k = opts_.schema == DbSchema::Normalized ? 1 : 0;
+    const std::string keys = kRollupKeys[k];
+    std::string sql = "BEGIN;";
+    sql += rollupTable("pm_rollup_hour", k);
+    sql += rollupTable("pm_rollup_day", k);
+    sql += kCounterIndex[k];
+    sql += "INSERT INTO pm_rollup_hour (bucket, " + keys + ", value_count, value_sum, value_min, value_max)"
+           " SELECT " + sqlFloorTo("t", kHour) + ", " + keys + ", count(*), sum(value), min(value), max(value)"
+           " FROM " + kRollupSource[k] + " WHERE t IS NOT NULL GROUP BY 1, 2, 3, 4;";
+    sql += "INSERT INTO pm_rollup_day (bucket, " + keys + ", value_count, value_sum, value_min, value_max)"
+           " SELECT " + sqlFloorTo("bucket", kDay) + ", " + keys +
+           ", sum(value_count), sum(value_sum), min(value_min), max(value_max)"
+           " FROM pm_rollup_hour GROUP BY 1, 2, 3, 4;";
+    sql += "COMMIT;";
+    if (!exec(sql.c_str(), "SQL error")) {
+        if (!sqlite3_get_autocommit(db_)) sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
         return false;
     }
+    rollups_ = true;
+    return (probe_ || prepareProbe()) && prepareUpserts();
+}
+
+bool DbWriter::prepareProbe() {
+    probe_ = prepare(opts_.schema == DbSchema::Normalized
+                         ? "SELECT 1 FROM pm_value WHERE ts = ? AND mo_id = ? LIMIT 1;"
+                         : "SELECT 1 FROM pm_counters WHERE timestamp = ? AND mo_ldn = ? LIMIT 1;");
+    split_ = probe_ != nullptr;
+    return split_;
+}
+
+bool DbWriter::prepareUpserts() {
+    const int k = opts_.schema == DbSchema::Normalized ? 1 : 0;
+    bool ok = true;
+    for (auto [upsert, table] : {std::make_pair(&upsertHour_, "pm_rollup_hour"),
+                                 std::make_pair(&upsertDay_, "pm_rollup_day")}) {
+        upsert->one = prepare(rollupUpsert(table, k, 1));
+        upsert->many = prepare(rollupUpsert(table, k, rowsPerUpsert_));
+        ok = ok && upsert->one && upsert->many;
+    }
+    return ok;
+}
 
-    sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
+sqlite3_stmt* DbWriter::prepare(const std::string& sql) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v3(db_, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Prepare error: " << sqlite3_errmsg(db_) << "\n";
+        return nullptr;
+    }
+    return stmt;
+}
 
-    sqlite3_stmt* stmt;
+sqlite3_stmt* DbWriter::prepareInsert(size_t rows) {
+    const bool normalized = opts_.schema == DbSchema::Normalized;
     // Use INSERT OR IGNORE to let unique index filter duplicates
-    const char* sql_ins = "INSERT OR IGNORE INTO pm_counters (timestamp, mo_ldn, meas_type, counter_name, value) VALUES (?, ?, ?, ?, ?);";
-    rc = sqlite3_prepare_v2(db, sql_ins, -1, &stmt, nullptr);
+    std::string sql = normalized ? "INSERT OR IGNORE INTO pm_value " : "INSERT OR IGNORE INTO pm_counters ";
+    sql += kColumns[normalized ? 1 : 0];
+    sql += " VALUES ";
+    for (size_t i = 0; i < rows; ++i) sql += i ? ",(?,?,?,?,?)" : "(?,?,?,?,?)";
+    return prepare(sql);
+}
 
-    if (rc != SQLITE_OK) {
-        std::cerr << "Prepare error: " << sqlite3_errmsg(db) << "\n";
-        sqlite3_close(db);
+bool DbWriter::prepareDimension(Dimension& dim, const char* table) {
+    dim.table = table;
+    dim.ids.clear();
+    dim.select = prepare(std::string("SELECT id FROM ") + table + " WHERE name = ?;");
+    dim.insert = prepare(std::string("INSERT INTO ") + table + " (name) VALUES (?);");
+    return dim.select && dim.insert;
+}
+
+void DbWriter::close() {
+    if (!db_) return;
+    flush();
+    if (insertOne_ != insertMany_) sqlite3_finalize(insertOne_);
+    sqlite3_finalize(insertMany_);
+    insertOne_ = insertMany_ = nullptr;
+    for (sqlite3_stmt** stmt : {&findFile_, &recordFile_, &touchFile_, &probe_, &upsertHour_.one, &upsertHour_.many,
+                                &upsertDay_.one, &upsertDay_.many}) {
+        sqlite3_finalize(*stmt);
+        *stmt = nullptr;
+    }
+    for (Dimension* dim : {&mos_, &measTypes_, &counters_}) {
+        sqlite3_finalize(dim->select);
+        sqlite3_finalize(dim->insert);
+        *dim = Dimension();
+    }
+    sqlite3_close(db_);
+    db_ = nullptr;
+    // Whatever was still uncommitted went with the connection.
+    inTransaction_ = false;
+    pending_ = 0;
+    rollups_ = split_ = false;
+}
+
+bool DbWriter::begin() {
+    if (inTransaction_) return true;
+    if (!exec("BEGIN TRANSACTION;", "SQL error")) return false;
+    inTransaction_ = true;
+    return true;
+}
+
+bool DbWriter::flush() {
+    if (!db_ || !inTransaction_) return true;
+    StageTimer t(&stats_.commitSeconds);
+    return commit();
+}
+
+bool DbWriter::commit() {
+    // Facts without their rollups must not be committed.
+    if (!writeRollups()) {
+        if (!sqlite3_get_autocommit(db_)) sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+        rolledBack();
+        return false;
+    }
+    if (beforeCommit_ && !beforeCommit_()) {
+        sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+        rolledBack();
+        return false;
+    }
+    // A COMMIT that fails with SQLITE_BUSY leaves the transaction open: its
+    // rows stay pending and go with the next flush(). Errors that rolled
+    // it back reset the writer like any other rollback.
+    if (!exec("COMMIT;", "Commit error")) {
+        rolledBack();
         return false;
     }
+    inTransaction_ = false;
+    pending_ = 0;
+    return true;
+}
 
-    for (const auto& r : filtered) {
-        sqlite3_bind_text(stmt, 1, r.timestamp.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, r.mo_ldn.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 3, r.meas_type.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 4, r.counter_name.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_double(stmt, 5, r.value);
+// Errors such as SQLITE_FULL roll the whole transaction back, taking any
+// dictionary rows added in it along.
+void DbWriter::rolledBack() {
+    if (!sqlite3_get_autocommit(db_)) return;
+    inTransaction_ = false;
+    pending_ = 0;
+    mos_.ids.clear();
+    measTypes_.ids.clear();
+    counters_.ids.clear();
+    hourly_.clear();
+    writeHourly_.clear();
+    rollupNames_.clear();
+}
 
-        sqlite3_step(stmt);
-        sqlite3_reset(stmt);
+// Takes back a failed write() inside the still open transaction. Ids the
+// dictionaries handed out in it may be gone, so their caches are reloaded.
+void DbWriter::undoWrite() {
+    if (sqlite3_get_autocommit(db_)) {
+        rolledBack();
+        return;
     }
+    sqlite3_exec(db_, "ROLLBACK TO pm_write; RELEASE pm_write;", nullptr, nullptr, nullptr);
+    mos_.ids.clear();
+    measTypes_.ids.clear();
+    counters_.ids.clear();
+}
 
-    sqlite3_finalize(stmt);
-    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
+bool DbWriter::step(sqlite3_stmt* stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc == SQLITE_DONE || rc == SQLITE_ROW) return true;
+    ++stats_.stepErrors;
+    std::cerr << "Ошибка вставки: " << sqlite3_errmsg(db_) << "\n";
+    rolledBack();
+    return false;
+}
+
+bool DbWriter::lookup(Dimension& dim, std::string_view name, int64_t& id) {
+    std::string key(name);
+    auto it = dim.ids.find(key);
+    if (it != dim.ids.end()) {
+        id = it->second;
+        return true;
+    }
+
+    sqlite3_bind_text(dim.select, 1, name.data(), static_cast<int>(name.size()), SQLITE_STATIC);
+    int rc = sqlite3_step(dim.select);
+    if (rc == SQLITE_ROW) {
+        id = sqlite3_column_int64(dim.select, 0);
+        sqlite3_reset(dim.select);
+    } else {
+        sqlite3_reset(dim.select);
+        sqlite3_bind_text(dim.insert, 1, name.data(), static_cast<int>(name.size()), SQLITE_STATIC);
+        if (!step(dim.insert)) return false;
+        id = sqlite3_last_insert_rowid(db_);
+    }
+    dim.ids.emplace(std::move(key), id);
+    return true;
+}
+
+// Resolves each distinct string of the batch against the dictionary once;
+// every further record using it is a vector index.
+bool DbWriter::mapIds(Dimension& dim, const StringPool& strings, uint32_t id, std::vector<int64_t>& map,
+                      int64_t& out) {
+    if (map[id] < 0 && !lookup(dim, strings.view(id), map[id])) return false;
+    out = map[id];
+    return true;
+}
+
+bool DbWriter::insertRows(RecordBatch& batch) {
+    const StringPool& s = batch.strings;
+    std::vector<PmRecord>& rows = batch.records;
+
+    // With rollups or insertedOnly, rows of an ROP and MO the table has never
+    // seen cannot collide and go first; the rest may repeat an earlier ingest
+    // and are inserted one at a time so the change count tells which ones
+    // were new.
+    size_t fresh = rows.size();
+    if (split_) {
+        tsMap_.assign(s.size(), kUnparsed);
+        rollupMap_.assign(s.size(), -1);
+        probed_.clear();
+        auto stored = [&](const PmRecord& r) {
+            auto [it, added] = probed_.try_emplace((static_cast<uint64_t>(r.timestamp) << 32) | r.mo, false);
+            if (added) {
+                std::string_view ts = s.view(r.timestamp), mo = s.view(r.mo);
+                sqlite3_bind_text(probe_, 1, ts.data(), static_cast<int>(ts.size()), SQLITE_STATIC);
+                sqlite3_bind_text(probe_, 2, mo.data(), static_cast<int>(mo.size()), SQLITE_STATIC);
+                it->second = sqlite3_step(probe_) == SQLITE_ROW;
+                sqlite3_reset(probe_);
+            }
+            return it->second;
+        };
+        fresh = std::stable_partition(rows.begin(), rows.end(), [&](const PmRecord& r) { return !stored(r); }) -
+                rows.begin();
+    }
+    // Rows with an unparsable timestamp are stored but have no hour to count in.
+    auto addRow = [&](const PmRecord& r) {
+        int64_t& ts = tsMap_[r.timestamp];
+        if (ts == kUnparsed && !parsePmTimestamp(s.view(r.timestamp), ts)) ts = kInvalid;
+        if (ts == kInvalid) return;
+        auto name = [&](uint32_t id) {
+            int64_t& n = rollupMap_[id];
+            if (n < 0) n = rollupNames_.intern(s.view(id));
+            return n;
+        };
+        addRollup(ts, name(r.mo), name(r.measType), name(r.counter), r.value);
+    };
+
+    const size_t chunk = opts_.rowsPerInsert;
+    size_t i = 0, kept = 0;
+    while (i < rows.size()) {
+        const size_t n = i < fresh && fresh - i >= chunk ? chunk : 1;
+        sqlite3_stmt* stmt = n == chunk ? insertMany_ : insertOne_;
+
+        // The batch outlives the step below, so SQLite can read the strings
+        // in place in the pool instead of copying each one.
+        int p = 1;
+        for (size_t k = 0; k < n; ++k) {
+            const PmRecord& r = rows[i + k];
+            for (uint32_t id : {r.timestamp, r.mo, r.measType, r.counter}) {
+                std::string_view v = s.view(id);
+                sqlite3_bind_text(stmt, p++, v.data(), static_cast<int>(v.size()), SQLITE_STATIC);
+            }
+            sqlite3_bind_double(stmt, p++, r.value);
+        }
+
+        if (!step(stmt)) return false;
+        if (i < fresh || sqlite3_changes(db_) > 0) {
+            for (size_t k = 0; k < n; ++k) {
+                if (rollups_) addRow(rows[i + k]);
+                rows[kept++] = rows[i + k]; // kept <= i + k
+            }
+        }
+        i += n;
+    }
+    if (opts_.insertedOnly) rows.resize(kept);
+    return true;
+}
 
-    std::cout << "Сохранено " << filtered.size() << " новых записей (из " << records.size() << ")\n";
+bool DbWriter::insertFacts(RecordBatch& batch) {
+    const StringPool& s = batch.strings;
+    for (auto* map : {&moMap_, &measTypeMap_, &counterMap_}) map->assign(s.size(), -1);
+    tsMap_.assign(s.size(), kUnparsed);
+    probed_.clear();
+
+    // Same split as in insertRows(): facts_ first holds the rows that cannot
+    // collide, retry_ the ones whose ROP and MO are already stored.
+    auto stored = [&](const PmRecord& r, const FactRow& f) {
+        auto [it, added] = probed_.try_emplace((static_cast<uint64_t>(r.timestamp) << 32) | r.mo, false);
+        if (added) {
+            sqlite3_bind_int64(probe_, 1, f.ts);
+            sqlite3_bind_int64(probe_, 2, f.mo);
+            it->second = sqlite3_step(probe_) == SQLITE_ROW;
+            sqlite3_reset(probe_);
+        }
+        return it->second;
+    };
+
+    facts_.clear();
+    retry_.clear();
+    size_t badTs = 0;
+    for (size_t row = 0; row < batch.records.size(); ++row) {
+        const PmRecord& r = batch.records[row];
+        int64_t& ts = tsMap_[r.timestamp];
+        if (ts == kUnparsed && !parsePmTimestamp(s.view(r.timestamp), ts)) ts = kInvalid;
+        if (ts == kInvalid) {
+            ++badTs;
+            continue;
+        }
+        FactRow f;
+        f.ts = ts;
+        f.value = r.value;
+        f.row = row;
+        if (!mapIds(mos_, s, r.mo, moMap_, f.mo) || !mapIds(measTypes_, s, r.measType, measTypeMap_, f.measType) ||
+            !mapIds(counters_, s, r.counter, counterMap_, f.counter)) {
+            return false;
+        }
+        if (split_ && stored(r, f)) retry_.push_back(f);
+        else facts_.push_back(f);
+    }
+    if (badTs) std::cerr << "Пропущено " << badTs << " записей с некорректным временем\n";
+    const size_t fresh = facts_.size();
+    facts_.insert(facts_.end(), retry_.begin(), retry_.end());
+    if (opts_.insertedOnly) inserted_.assign(batch.records.size(), 0);
+
+    const size_t chunk = opts_.rowsPerInsert;
+    size_t i = 0;
+    while (i < facts_.size()) {
+        const size_t n = i < fresh && fresh - i >= chunk ? chunk : 1;
+        sqlite3_stmt* stmt = n == chunk ? insertMany_ : insertOne_;
+
+        int p = 1;
+        for (size_t k = 0; k < n; ++k) {
+            const FactRow& f = facts_[i + k];
+            sqlite3_bind_int64(stmt, p++, f.ts);
+            sqlite3_bind_int64(stmt, p++, f.mo);
+            sqlite3_bind_int64(stmt, p++, f.measType);
+            sqlite3_bind_int64(stmt, p++, f.counter);
+            sqlite3_bind_double(stmt, p++, f.value);
+        }
+
+        if (!step(stmt)) return false;
+        if (i < fresh || sqlite3_changes(db_) > 0) {
+            for (size_t k = 0; k < n; ++k) {
+                const FactRow& f = facts_[i + k];
+                if (rollups_) addRollup(f.ts, f.mo, f.measType, f.counter, f.value);
+                if (opts_.insertedOnly) inserted_[f.row] = 1;
+            }
+        }
+        i += n;
+    }
+    if (opts_.insertedOnly) {
+        std::vector<PmRecord>& rows = batch.records;
+        size_t kept = 0;
+        for (size_t row = 0; row < rows.size(); ++row) {
+            if (inserted_[row]) rows[kept++] = rows[row];
+        }
+        rows.resize(kept);
+    }
     return true;
 }
 
+void DbWriter::RollupValue::add(int64_t n, double s, double lo, double hi) {
+    min = count ? std::min(min, lo) : lo;
+    max = count ? std::max(max, hi) : hi;
+    count += n;
+    sum += s;
+}
+
+size_t DbWriter::RollupKeyHash::operator()(const RollupKey& k) const {
+    uint64_t h = static_cast<uint64_t>(k.bucket);
+    for (int64_t v : {k.mo, k.measType, k.counter}) h = (h ^ static_cast<uint64_t>(v)) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+}
+
+void DbWriter::addRollup(int64_t ts, int64_t mo, int64_t measType, int64_t counter, double value) {
+    writeHourly_[{floorTo(ts, kHour), mo, measType, counter}].add(1, value, value, value);
+}
+
+void DbWriter::bindRollup(sqlite3_stmt* stmt, int& p, const RollupKey& k, const RollupValue& v) {
+    const bool normalized = opts_.schema == DbSchema::Normalized;
+    sqlite3_bind_int64(stmt, p++, k.bucket);
+    for (int64_t id : {k.mo, k.measType, k.counter}) {
+        if (normalized) {
+            sqlite3_bind_int64(stmt, p++, id);
+        } else {
+            std::string_view name = rollupNames_.view(static_cast<uint32_t>(id));
+            sqlite3_bind_text(stmt, p++, name.data(), static_cast<int>(name.size()), SQLITE_STATIC);
+        }
+    }
+    sqlite3_bind_int64(stmt, p++, v.count);
+    sqlite3_bind_double(stmt, p++, v.sum);
+    sqlite3_bind_double(stmt, p++, v.min);
+    sqlite3_bind_double(stmt, p++, v.max);
+}
+
+// Merges the hours summed in this transaction into both rollup tables, in
+// key order so the b-tree sees mostly appends.
+bool DbWriter::writeRollups() {
+    if (hourly_.empty()) return true;
+
+    std::vector<std::pair<RollupKey, RollupValue>> rows(hourly_.begin(), hourly_.end());
+    RollupMap daily;
+    for (const auto& [k, v] : rows) {
+        RollupKey d = k;
+        d.bucket = floorTo(k.bucket, kDay);
+        daily[d].add(v.count, v.sum, v.min, v.max);
+    }
+
+    // Flat keys are pool ids, so their order comes from the names.
+    const bool normalized = opts_.schema == DbSchema::Normalized;
+    auto less = [&](int64_t a, int64_t b) {
+        if (normalized) return a < b;
+        return rollupNames_.view(static_cast<uint32_t>(a)) < rollupNames_.view(static_cast<uint32_t>(b));
+    };
+    auto byKey = [&](const std::pair<RollupKey, RollupValue>& a, const std::pair<RollupKey, RollupValue>& b) {
+        const RollupKey &x = a.first, &y = b.first;
+        if (x.counter != y.counter) return less(x.counter, y.counter);
+        if (x.mo != y.mo) return less(x.mo, y.mo);
+        if (x.measType != y.measType) return less(x.measType, y.measType);
+        return x.bucket < y.bucket;
+    };
+    bool ok = true;
+    for (const Upsert* upsert : {&upsertHour_, &upsertDay_}) {
+        if (upsert == &upsertDay_) rows.assign(daily.begin(), daily.end());
+        std::sort(rows.begin(), rows.end(), byKey);
+        for (size_t i = 0; ok && i < rows.size();) {
+            const size_t n = rows.size() - i >= rowsPerUpsert_ ? rowsPerUpsert_ : 1;
+            sqlite3_stmt* stmt = n == rowsPerUpsert_ ? upsert->many : upsert->one;
+            int p = 1;
+            for (size_t k = 0; k < n; ++k) bindRollup(stmt, p, rows[i + k].first, rows[i + k].second);
+            ok = step(stmt);
+            i += n;
+        }
+    }
+    hourly_.clear();
+    rollupNames_.clear();
+    return ok;
+}
+
+bool DbWriter::findFile(const std::string& path, FileStamp& out) {
+    if (!db_) return false;
+    sqlite3_bind_text(findFile_, 1, path.data(), static_cast<int>(path.size()), SQLITE_STATIC);
+    bool found = sqlite3_step(findFile_) == SQLITE_ROW;
+    if (found) {
+        out.path = path;
+        out.size = static_cast<uint64_t>(sqlite3_column_int64(findFile_, 0));
+        out.mtime = sqlite3_column_int64(findFile_, 1);
+        out.hash = static_cast<uint64_t>(sqlite3_column_int64(findFile_, 2));
+    }
+    sqlite3_reset(findFile_);
+    return found;
+}
+
+bool DbWriter::touchFile(const FileStamp& file) {
+    if (!db_ || !begin()) return false;
+    sqlite3_bind_int64(touchFile_, 1, file.mtime);
+    sqlite3_bind_text(touchFile_, 2, file.path.data(), static_cast<int>(file.path.size()), SQLITE_STATIC);
+    return step(touchFile_);
+}
+
+bool DbWriter::recordFile(const FileStamp& file, size_t records) {
+    sqlite3_bind_text(recordFile_, 1, file.path.data(), static_cast<int>(file.path.size()), SQLITE_STATIC);
+    sqlite3_bind_int64(recordFile_, 2, static_cast<int64_t>(file.size));
+    sqlite3_bind_int64(recordFile_, 3, file.mtime);
+    sqlite3_bind_int64(recordFile_, 4, static_cast<int64_t>(file.hash));
+    sqlite3_bind_int64(recordFile_, 5, static_cast<int64_t>(records));
+    return step(recordFile_);
+}
+
+bool DbWriter::write(RecordBatch& batch, const FileStamp* file) {
+    if (batch.records.empty() && !file) return true;
+    if (!db_) return false;
+    // Committed before this call adds to the transaction, not after it: by
+    // then the caller has passed the earlier rows on (see setBeforeCommit()).
+    if (pending_ >= opts_.commitBatch && !flush()) return false;
 
+    // In-memory dedupe to reduce DB work
+    const size_t total = batch.records.size();
+    {
+        StageTimer t(&stats_.dedupeSeconds);
+        stats_.duplicates += batch.dedupe();
+    }
+
+    // Keep each call inside one transaction; the commit threshold is only
+    // checked between calls.
+    // A savepoint per call, so a failed step takes back this call's rows
+    // and nothing else; SQLite only rolls back on its own for some errors.
+    bool ok;
+    {
+        StageTimer t(&stats_.insertSeconds);
+        if (!begin() || !exec("SAVEPOINT pm_write;", "SQL error")) return false;
+        ok = opts_.schema == DbSchema::Normalized ? insertFacts(batch) : insertRows(batch);
+        if (ok && file) ok = recordFile(*file, total);
+        if (ok) ok = exec("RELEASE pm_write;", "SQL error");
+        if (ok) {
+            for (const auto& [k, v] : writeHourly_) hourly_[k].add(v.count, v.sum, v.min, v.max);
+        } else {
+            undoWrite();
+        }
+        writeHourly_.clear();
+    }
+    pending_ += batch.records.size();
+
+    if (ok && !opts_.quiet) std::cout << "Сохранено " << batch.records.size() << " новых записей (из " << total << ")\n";
+    return ok;
+}
+
+bool DbWriter::write(const std::vector<CounterRecord>& records) {
+    if (records.empty()) return true;
+    scratch_.clear();
+    scratch_.records.reserve(records.size());
+    for (const auto& r : records) scratch_.add(r);
+    return write(scratch_);
+}
+
+bool isJournalMode(const std::string& mode) {
+    return oneOf(mode, {"WAL", "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "OFF"});
+}
+
+bool isSynchronousMode(const std::string& mode) {
+    return oneOf(mode, {"OFF", "NORMAL", "FULL", "EXTRA"});
+}
+
+bool initDatabase(const std::string& dbPath) {
+    DbWriter db;
+    return db.open(dbPath);
+}
+
+bool saveRecords(const std::string& dbPath, const std::vector<CounterRecord>& records) {
+    if (records.empty()) return true;
+    DbWriter db;
+    if (!db.open(dbPath)) return false;
+    bool ok = db.write(records);
+    return db.flush() && ok;
+}
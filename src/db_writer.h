@@ -1,8 +1,214 @@
 #pragma once
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include "xml_parser.h"
+#include "record_batch.h"
 
+struct sqlite3;
+struct sqlite3_stmt;
+
+enum class DbSchema {
+    // pm_counters table with the DN, names and ISO timestamp in every row.
+    Flat,
+    // pm_mo / pm_meas_type / pm_counter dictionaries, integer-keyed pm_value
+    // facts with epoch timestamps, and a pm_counters view of the flat shape.
+    Normalized,
+};
+
+struct DbOptions {
+    DbSchema schema = DbSchema::Flat;
+    std::string journalMode = "WAL";
+    std::string synchronous = "NORMAL";
+    int cacheSizeKb = 64 * 1024;          // PRAGMA cache_size = -N
+    int64_t mmapSize = 256LL * 1024 * 1024; // PRAGMA mmap_size, 0 = off
+    int pageSize = 0;                     // 0 = SQLite default; only applies to a new file
+    size_t commitBatch = 100000;          // rows per transaction
+    size_t rowsPerInsert = 64;            // rows bound into one INSERT statement
+    int busyTimeoutMs = 5000;             // wait for other connections' locks
+    bool quiet = false;                   // no console line per write()
+    // Create pm_rollup_hour / pm_rollup_day and the counter index. Off by
+    // default: keeping them costs a lookup per ROP and MO of every batch.
+    // Only decides for a database without them, and only while it has no
+    // facts (see buildRollups()); existing rollups are always kept up to date.
+    bool rollups = false;
+    // write() leaves only the rows SQLite actually inserted in the batch,
+    // for consumers that must see exactly the stored rows (--segments).
+    // Costs one lookup per ROP and MO of a batch, like the rollups.
+    bool insertedOnly = false;
+};
+
+// Running totals of a DbWriter for the ingest metrics.
+struct DbStats {
+    uint64_t duplicates = 0;  // dropped by the in-batch dedupe
+    uint64_t stepErrors = 0;  // failed sqlite3_step calls
+    double dedupeSeconds = 0.0;
+    double insertSeconds = 0.0; // binding and stepping, manifest and rollup bookkeeping
+    double commitSeconds = 0.0; // COMMIT including the rollup upserts
+};
+
+// Identity of an ingested file as kept in the ingest_manifest table.
+struct FileStamp {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0; // Unix seconds
+    uint64_t hash = 0; // FNV-1a of the content
+};
+
+// One SQLite connection kept open for the whole run. Rows go into an open
+// transaction that is committed every `commitBatch` rows, on flush() and on
+// close(), so the per-file cost is just binding and stepping.
+//
+// With rollups the rows actually inserted are also summed per hour in RAM
+// and merged into the rollup tables right before each commit, so facts and
+// rollups always change together and are never rebuilt.
+class DbWriter {
+public:
+    explicit DbWriter(DbOptions opts = {});
+    ~DbWriter();
+
+    DbWriter(const DbWriter&) = delete;
+    DbWriter& operator=(const DbWriter&) = delete;
+
+    // Opens `dbPath`, applies the PRAGMAs, creates the schema and prepares
+    // the insert statements.
+    bool open(const std::string& dbPath);
+
+    // Drops duplicates within `batch` (in place, possibly reordering it) and
+    // inserts the rest; with DbOptions::insertedOnly rows already in the
+    // database are dropped from it too. When `file` is given it is recorded
+    // in the manifest in the same transaction as its rows. Returns false if
+    // any row failed to insert.
+    bool write(RecordBatch& batch, const FileStamp* file = nullptr);
+
+    // Same for owning records; they are interned into a scratch batch first.
+    bool write(const std::vector<CounterRecord>& records);
+
+    // Looks `path` up in the manifest. Returns false if it was never ingested.
+    bool findFile(const std::string& path, FileStamp& out);
+
+    // Stores the new mtime of a file whose content did not change.
+    bool touchFile(const FileStamp& file);
+
+    // Creates the rollup tables and the counter index for a database opened
+    // without them and fills them from the facts already loaded, in one
+    // transaction; later writes keep them current. Slow on a large database,
+    // so open() never does this on its own. Commits pending rows first.
+    bool buildRollups();
+
+    // Commits the open transaction, if any.
+    bool flush();
+
+    // Runs `hook` right before each COMMIT; if it returns false the
+    // transaction is rolled back instead. The commitBatch threshold is
+    // checked when the next write() starts, so a commit only ever holds
+    // rows of calls that have already returned.
+    void setBeforeCommit(std::function<bool()> hook) { beforeCommit_ = std::move(hook); }
+
+    void close();
+
+    bool isOpen() const { return db_ != nullptr; }
+    uint64_t stepErrors() const { return stats_.stepErrors; }
+    const DbStats& stats() const { return stats_; }
+
+private:
+    // Name -> id table of the normalized schema with its ids cached in RAM.
+    struct Dimension {
+        const char* table = nullptr;
+        sqlite3_stmt* select = nullptr;
+        sqlite3_stmt* insert = nullptr;
+        std::unordered_map<std::string, int64_t> ids;
+    };
+
+    struct FactRow {
+        int64_t ts, mo, measType, counter;
+        double value;
+        size_t row; // index in the batch
+    };
+
+    // Rollup row key: dictionary ids (normalized) or rollupNames_ ids (flat).
+    struct RollupKey {
+        int64_t bucket, mo, measType, counter;
+        bool operator==(const RollupKey& o) const {
+            return bucket == o.bucket && mo == o.mo && measType == o.measType && counter == o.counter;
+        }
+    };
+    struct RollupKeyHash {
+        size_t operator()(const RollupKey& k) const;
+    };
+    struct RollupValue {
+        int64_t count = 0;
+        double sum = 0.0, min = 0.0, max = 0.0;
+        void add(int64_t n, double s, double lo, double hi);
+    };
+    using RollupMap = std::unordered_map<RollupKey, RollupValue, RollupKeyHash>;
+
+    // Single-row and rowsPerUpsert_-row variants of one rollup upsert.
+    struct Upsert {
+        sqlite3_stmt* one = nullptr;
+        sqlite3_stmt* many = nullptr;
+    };
+
+    bool exec(const char* sql, const char* what);
+    bool createSchema();
+    bool begin();
+    bool commit();
+    void rolledBack();
+    void undoWrite();
+    sqlite3_stmt* prepare(const std::string& sql);
+    sqlite3_stmt* prepareInsert(size_t rows);
+    bool prepareDimension(Dimension& dim, const char* table);
+    bool lookup(Dimension& dim, std::string_view name, int64_t& id);
+    bool mapIds(Dimension& dim, const StringPool& strings, uint32_t id, std::vector<int64_t>& map, int64_t& out);
+    bool step(sqlite3_stmt* stmt);
+    bool insertRows(RecordBatch& batch);
+    bool insertFacts(RecordBatch& batch);
+    bool recordFile(const FileStamp& file, size_t records);
+    bool createRollups();
+    bool prepareProbe();
+    bool prepareUpserts();
+    void addRollup(int64_t ts, int64_t mo, int64_t measType, int64_t counter, double value);
+    void bindRollup(sqlite3_stmt* stmt, int& p, const RollupKey& k, const RollupValue& v);
+    bool writeRollups();
+
+    DbOptions opts_;
+    sqlite3* db_ = nullptr;
+    sqlite3_stmt* insertMany_ = nullptr;
+    sqlite3_stmt* insertOne_ = nullptr;
+    sqlite3_stmt* findFile_ = nullptr;
+    sqlite3_stmt* recordFile_ = nullptr;
+    sqlite3_stmt* touchFile_ = nullptr;
+    sqlite3_stmt* probe_ = nullptr;
+    Upsert upsertHour_, upsertDay_;
+    size_t rowsPerUpsert_ = 1;
+    Dimension mos_, measTypes_, counters_;
+    // Per-batch pool id -> database id / epoch translation, reused.
+    std::vector<int64_t> moMap_, measTypeMap_, counterMap_, tsMap_;
+    std::vector<FactRow> facts_, retry_;
+    std::vector<char> inserted_; // per batch row, normalized insertedOnly
+    bool rollups_ = false;
+    bool split_ = false; // rollups_ or insertedOnly: tell new rows from stored ones
+    RollupMap hourly_;      // inserted in the open transaction
+    RollupMap writeHourly_; // inserted by the current write(), not yet in hourly_
+    StringPool rollupNames_;
+    std::vector<int64_t> rollupMap_; // per batch: pool id -> rollupNames_ id
+    std::unordered_map<uint64_t, bool> probed_; // per batch: (ts, mo) pool ids -> rows exist
+    RecordBatch scratch_;
+    bool inTransaction_ = false;
+    size_t pending_ = 0;
+    std::function<bool()> beforeCommit_;
+    DbStats stats_;
+};
+
+// Values accepted for DbOptions::journalMode (WAL, DELETE, TRUNCATE,
+// PERSIST, MEMORY, OFF) and DbOptions::synchronous (OFF, NORMAL, FULL,
+// EXTRA), in any case. They end up in PRAGMA statements as is.
+bool isJournalMode(const std::string& mode);
+bool isSynchronousMode(const std::string& mode);
+
+// Single-shot helpers kept for callers that do not hold a DbWriter; each
+// call opens and closes its own connection.
 bool initDatabase(const std::string& dbPath);
 bool saveRecords(const std::string& dbPath, const std::vector<CounterRecord>& records);
-
@@ -0,0 +1,111 @@
+#include "dir_watch.h"
+#include "ingest.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// After the first event keep collecting until the directory has been quiet
+// this long (or for at most kMaxBatch), so a burst of ROP files is ingested
+// as one batch.
+constexpr int kQuietMs = 200;
+constexpr int kMaxBatchMs = 2000;
+constexpr int kStopCheckMs = 500;
+
+} // namespace
+
+#ifdef __linux__
+
+DirWatcher::DirWatcher(const std::string& dir, int pollSeconds) : dir_(dir), pollSeconds_(pollSeconds) {
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0 || inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        std::cerr << "Ошибка inotify для " << dir << ": " << std::strerror(errno) << "\n";
+        return;
+    }
+    ok_ = true;
+}
+
+DirWatcher::~DirWatcher() {
+    if (fd_ >= 0) close(fd_);
+}
+
+void DirWatcher::wait(std::vector<std::string>& out, const std::atomic<bool>& stop) {
+    alignas(inotify_event) char buf[64 * 1024];
+    bool overflow = false;
+    size_t before = out.size();
+    auto first = std::chrono::steady_clock::time_point();
+
+    while (!stop) {
+        int timeout = kStopCheckMs;
+        if (out.size() > before || overflow) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - first).count();
+            if (elapsed >= kMaxBatchMs) break;
+            timeout = static_cast<int>(std::min<long long>(kQuietMs, kMaxBatchMs - elapsed));
+        }
+
+        pollfd pfd{fd_, POLLIN, 0};
+        int rc = poll(&pfd, 1, timeout);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) {
+            if (out.size() > before || overflow) break; // quiet period over
+            continue;
+        }
+
+        ssize_t n;
+        while ((n = read(fd_, buf, sizeof buf)) > 0) {
+            for (char* p = buf; p < buf + n;) {
+                auto* ev = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) overflow = true;
+                if (ev->len == 0 || (ev->mask & IN_ISDIR)) continue;
+                std::string path = (fs::path(dir_) / ev->name).string();
+                if (isPmFile(path)) out.push_back(path);
+            }
+        }
+        if (first == std::chrono::steady_clock::time_point() && (out.size() > before || overflow)) {
+            first = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Events were lost; the manifest makes a full rescan cheap.
+    if (overflow) {
+        out.resize(before);
+        for (auto& f : listPmFiles(dir_)) out.push_back(std::move(f));
+    }
+
+    // A file rewritten within the batch shows up more than once.
+    std::sort(out.begin() + before, out.end());
+    out.erase(std::unique(out.begin() + before, out.end()), out.end());
+}
+
+#else
+
+DirWatcher::DirWatcher(const std::string& dir, int pollSeconds) : dir_(dir), pollSeconds_(pollSeconds) {
+    ok_ = fs::is_directory(dir);
+}
+
+DirWatcher::~DirWatcher() = default;
+
+void DirWatcher::wait(std::vector<std::string>& out, const std::atomic<bool>& stop) {
+    for (int waited = 0; waited < pollSeconds_ * 1000 && !stop; waited += kStopCheckMs) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(kStopCheckMs));
+    }
+    if (stop) return;
+    for (auto& f : listPmFiles(dir_)) out.push_back(std::move(f));
+}
+
+#endif
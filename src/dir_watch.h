@@ -0,0 +1,29 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Reports PM files that appear in a directory. On Linux this is inotify
+// (files closed after writing or moved in); elsewhere the directory is
+// rescanned every `pollSeconds` and the ingest manifest filters out what
+// was already loaded.
+class DirWatcher {
+public:
+    explicit DirWatcher(const std::string& dir, int pollSeconds = 5);
+    ~DirWatcher();
+
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    bool ok() const { return ok_; }
+
+    // Blocks until new files arrived or `stop` is set, then appends their
+    // paths to `out`. Files landing close together are returned together.
+    void wait(std::vector<std::string>& out, const std::atomic<bool>& stop);
+
+private:
+    std::string dir_;
+    int pollSeconds_;
+    bool ok_ = false;
+    int fd_ = -1;
+};
@@ -0,0 +1,355 @@
+#include "ingest.h"
+#include "xml_parser.h"
+#include "db_writer.h"
+#include "record_batch.h"
+#include "segment_store.h"
+#include "input_source.h"
+#include "metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point t0) {
+    return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+struct StageStats {
+    size_t skipped = 0; // unchanged according to the manifest
+    size_t files = 0;
+    size_t records = 0;
+    uintmax_t bytes = 0;
+    double parseSeconds = 0.0; // summed over parser threads
+    double writeSeconds = 0.0;
+};
+
+void printStats(const StageStats& s, unsigned jobs, double wallSeconds) {
+    auto rate = [](double n, double sec) { return sec > 0.0 ? n / sec : 0.0; };
+    const double mb = s.bytes / (1024.0 * 1024.0);
+    if (s.skipped) std::cout << "Пропущено без изменений: " << s.skipped << " файлов\n";
+    std::cout << "Разбор: " << s.files << " файлов, " << s.records << " записей, " << mb << " МБ за "
+              << s.parseSeconds << " с в " << jobs << " потоках ("
+              << rate(s.records, s.parseSeconds) << " зап/с, " << rate(mb, s.parseSeconds) << " МБ/с на поток)\n";
+    std::cout << "Запись: " << s.records << " записей за " << s.writeSeconds << " с ("
+              << rate(s.records, s.writeSeconds) << " зап/с)\n";
+    std::cout << "Всего: " << wallSeconds << " с (" << rate(s.records, wallSeconds) << " зап/с, "
+              << rate(mb, wallSeconds) << " МБ/с)\n";
+}
+
+// What the DbWriter did between two stats() snapshots.
+IngestCounters dbDelta(const DbStats& before, const DbStats& after) {
+    IngestCounters c;
+    c[Stage::Dedupe] = after.dedupeSeconds - before.dedupeSeconds;
+    c[Stage::Insert] = after.insertSeconds - before.insertSeconds;
+    c[Stage::Commit] = after.commitSeconds - before.commitSeconds;
+    c.duplicates = after.duplicates - before.duplicates;
+    c.errors = after.stepErrors - before.stepErrors;
+    return c;
+}
+
+// Stage split of one file: `parseSeconds` is the whole parse call, of which
+// ParseInfo has the read and record-build parts; `db` is dbDelta() around
+// its write. `stored` is false if parsing or writing failed.
+void reportFile(IngestMetrics* metrics, const std::string& path, double parseSeconds, const ParseInfo& info,
+                size_t records, bool stored, IngestCounters db) {
+    if (!metrics) return;
+    db[Stage::Read] = info.readSeconds;
+    db[Stage::Build] = info.buildSeconds;
+    db[Stage::Parse] = std::max(0.0, parseSeconds - info.readSeconds - info.buildSeconds);
+    db.files = 1;
+    db.bytes = info.bytes;
+    db.records = records;
+    if (!stored && db.errors == 0) db.errors = 1;
+    metrics->addFile(path, db);
+}
+
+// Unix seconds of a file_time_type. C++17 has no clock_cast, but the
+// file clock epoch sits a whole number of seconds away from the Unix one
+// on every library we build with, so the offset is measured once and
+// rounded to seconds; the result does not change between runs.
+int64_t unixSeconds(fs::file_time_type t) {
+    using namespace std::chrono;
+    static const int64_t offset = [] {
+        const auto sys = system_clock::now().time_since_epoch();
+        const auto file = fs::file_time_type::clock::now().time_since_epoch();
+        return static_cast<int64_t>(std::llround(duration<double>(sys - file).count()));
+    }();
+    return static_cast<int64_t>(floor<seconds>(t.time_since_epoch()).count()) + offset;
+}
+
+bool stampFile(const std::string& path, FileStamp& out) {
+    std::error_code ec;
+    fs::path abs = fs::absolute(path, ec).lexically_normal();
+    if (ec) return false;
+    out.path = abs.string();
+    out.size = fs::file_size(abs, ec);
+    if (ec) return false;
+    auto mtime = fs::last_write_time(abs, ec);
+    if (ec) return false;
+    out.mtime = unixSeconds(mtime);
+    return true;
+}
+
+// Decides from the manifest whether `file` still has to be parsed.
+bool needsIngest(DbWriter& db, const FileStamp& file) {
+    FileStamp known;
+    if (!db.findFile(file.path, known)) return true;
+    if (known.size != file.size) return true;
+    if (known.mtime == file.mtime) return false;
+
+    // Same size but touched: compare content before paying for a parse.
+    FileStamp touched = file;
+    if (!hashFile(file.path, touched.hash) || touched.hash != known.hash) return true;
+    db.touchFile(touched);
+    return false;
+}
+
+bool ingestSerial(const std::vector<FileStamp>& files, DbWriter& db, SegmentWriter* segments,
+                  const IngestOptions& opts, StageStats& stats) {
+    RecordBatch batch;
+    bool allOk = true;
+    for (const auto& file : files) {
+        if (!opts.quiet) std::cout << "Обработка: " << fs::path(file.path).filename() << "\n";
+        batch.clear();
+        ParseInfo info;
+        auto t0 = Clock::now();
+        bool ok = parse_ericsson_pm_xml(file.path, batch, &info);
+        const double parseSeconds = secondsSince(t0);
+        stats.parseSeconds += parseSeconds;
+        ++stats.files;
+        stats.bytes += info.bytes;
+        if (!ok) {
+            reportFile(opts.metrics, file.path, parseSeconds, info, 0, false, {});
+            allOk = false;
+            continue;
+        }
+        const size_t records = batch.records.size();
+        stats.records += records;
+        FileStamp done = file;
+        done.hash = info.contentHash;
+        const DbStats before = db.stats();
+        t0 = Clock::now();
+        ok = db.write(batch, &done);
+        // Only rows the database kept, so segments and tables agree.
+        const bool segOk = !ok || !segments || segments->write(batch);
+        stats.writeSeconds += secondsSince(t0);
+        reportFile(opts.metrics, file.path, parseSeconds, info, records, ok, dbDelta(before, db.stats()));
+        if (!ok || !segOk) allOk = false;
+    }
+    return allOk;
+}
+
+// Parser threads claim the next unparsed file from a shared cursor, so a
+// slow file never holds up the others. A thread has to take a queue slot
+// before it claims a file and the writer returns the slot once it has
+// taken the result; claimed indices therefore always lie within
+// `capacity` files of the writer and the in-order hand-off cannot stall.
+class Pipeline {
+public:
+    Pipeline(const std::vector<FileStamp>& files, DbWriter& db, SegmentWriter* segments, const IngestOptions& opts)
+        : files_(files), db_(db), segments_(segments), opts_(opts),
+          capacity_(opts.queueFiles ? opts.queueFiles : 2 * static_cast<size_t>(opts.jobs)) {}
+
+    bool run(StageStats& stats) {
+        std::vector<std::thread> parsers;
+        parsers.reserve(opts_.jobs);
+        for (unsigned i = 0; i < opts_.jobs; ++i) parsers.emplace_back([this] { parseLoop(); });
+        std::thread writer([this, &stats] { writeLoop(stats); });
+
+        for (auto& t : parsers) t.join();
+        writer.join();
+
+        stats.parseSeconds = parseSeconds_;
+        stats.bytes = bytes_;
+        return !failed_;
+    }
+
+private:
+    struct Parsed {
+        bool ok = false;
+        double seconds = 0.0;
+        ParseInfo info;
+        RecordBatch batch;
+    };
+
+    void parseLoop() {
+        for (;;) {
+            size_t idx;
+            {
+                std::unique_lock<std::mutex> lk(m_);
+                slotFree_.wait(lk, [this] { return inFlight_ < capacity_ || next_ >= files_.size(); });
+                if (next_ >= files_.size()) return;
+                idx = next_++;
+                ++inFlight_;
+            }
+
+            Parsed p = takeSpare();
+            auto t0 = Clock::now();
+            p.ok = parse_ericsson_pm_xml(files_[idx].path, p.batch, &p.info);
+            p.seconds = secondsSince(t0);
+
+            {
+                std::lock_guard<std::mutex> lk(m_);
+                parseSeconds_ += p.seconds;
+                bytes_ += p.info.bytes;
+                ready_.emplace(idx, std::move(p));
+            }
+            readyCv_.notify_one();
+        }
+    }
+
+    // Records of many files share one transaction; DbWriter commits every
+    // DbOptions::commitBatch rows, flushing the segments first.
+    void writeLoop(StageStats& stats) {
+        for (size_t want = 0; want < files_.size(); ++want) {
+            Parsed p;
+            {
+                std::unique_lock<std::mutex> lk(m_);
+                readyCv_.wait(lk, [&] { return ready_.count(want) != 0; });
+                auto it = ready_.find(want);
+                p = std::move(it->second);
+                ready_.erase(it);
+                --inFlight_;
+            }
+            slotFree_.notify_all();
+
+            const std::string& path = files_[want].path;
+            if (!opts_.quiet) std::cout << "Обработка: " << fs::path(path).filename() << "\n";
+            ++stats.files;
+            if (!p.ok) {
+                reportFile(opts_.metrics, path, p.seconds, p.info, 0, false, {});
+                failed_ = true;
+                giveBack(std::move(p));
+                continue;
+            }
+            const size_t records = p.batch.records.size();
+            stats.records += records;
+            FileStamp done = files_[want];
+            done.hash = p.info.contentHash;
+            const DbStats before = db_.stats();
+            auto t0 = Clock::now();
+            bool ok = db_.write(p.batch, &done);
+            const bool segOk = !ok || !segments_ || segments_->write(p.batch);
+            stats.writeSeconds += secondsSince(t0);
+            reportFile(opts_.metrics, path, p.seconds, p.info, records, ok, dbDelta(before, db_.stats()));
+            if (!ok || !segOk) failed_ = true;
+            giveBack(std::move(p));
+        }
+    }
+
+    // Batches go back to the parsers once written, so after the first few
+    // files their record vectors and string arenas no longer allocate.
+    Parsed takeSpare() {
+        std::lock_guard<std::mutex> lk(m_);
+        if (spare_.empty()) return Parsed();
+        Parsed p = std::move(spare_.back());
+        spare_.pop_back();
+        p.batch.clear();
+        p.info = ParseInfo();
+        return p;
+    }
+
+    void giveBack(Parsed p) {
+        std::lock_guard<std::mutex> lk(m_);
+        spare_.push_back(std::move(p));
+    }
+
+    const std::vector<FileStamp>& files_;
+    DbWriter& db_;
+    SegmentWriter* segments_;
+    const IngestOptions& opts_;
+    const size_t capacity_;
+
+    std::mutex m_;
+    std::condition_variable slotFree_;
+    std::condition_variable readyCv_;
+    std::map<size_t, Parsed> ready_;
+    std::vector<Parsed> spare_;
+    size_t next_ = 0;
+    size_t inFlight_ = 0;
+    double parseSeconds_ = 0.0;
+    uintmax_t bytes_ = 0;
+    bool failed_ = false; // writer thread only
+};
+
+} // namespace
+
+bool ingestFiles(const std::vector<std::string>& files, DbWriter& db, const IngestOptions& opts,
+                 SegmentWriter* segments) {
+    StageStats stats;
+    auto t0 = Clock::now();
+    unsigned jobs = opts.jobs ? opts.jobs : 1;
+
+    // Segment rows must be on disk before the commit that records their
+    // files in the manifest, or a failed segment write would never be
+    // retried.
+    if (segments) db.setBeforeCommit([segments] { return segments->flush(); });
+
+    bool ok = true;
+    std::vector<FileStamp> todo;
+    todo.reserve(files.size());
+    for (const auto& path : files) {
+        FileStamp file;
+        if (!stampFile(path, file)) {
+            std::cerr << "Не удалось прочитать атрибуты файла " << path << "\n";
+            ok = false;
+            continue;
+        }
+        if (opts.useManifest && !needsIngest(db, file)) {
+            ++stats.skipped;
+            continue;
+        }
+        todo.push_back(std::move(file));
+    }
+
+    if (jobs <= 1 || todo.size() <= 1) {
+        jobs = 1;
+        if (!ingestSerial(todo, db, segments, opts, stats)) ok = false;
+    } else {
+        IngestOptions o = opts;
+        o.jobs = jobs;
+        if (!Pipeline(todo, db, segments, o).run(stats)) ok = false;
+    }
+
+    auto tc = Clock::now();
+    const DbStats before = db.stats();
+    if (!db.flush()) ok = false;
+    if (opts.metrics) {
+        IngestCounters tail = dbDelta(before, db.stats());
+        tail.skipped = stats.skipped;
+        opts.metrics->add(tail);
+    }
+    db.setBeforeCommit(nullptr);
+    stats.writeSeconds += secondsSince(tc);
+
+    printStats(stats, jobs, secondsSince(t0));
+    return ok;
+}
+
+bool isPmFile(const std::string& path) {
+    fs::path p(path);
+    if (p.extension() == ".gz") p = p.stem();
+    return p.extension() == ".xml";
+}
+
+std::vector<std::string> listPmFiles(const std::string& dir) {
+    std::vector<std::string> files;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.is_regular_file() && isPmFile(entry.path().string())) files.push_back(entry.path().string());
+    }
+    return files;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class DbWriter;
+class IngestMetrics;
+class SegmentWriter;
+
+struct IngestOptions {
+    // Parser threads; 1 keeps the original parse-then-save loop.
+    unsigned jobs = 1;
+    // Parsed files the parsers may run ahead of the writer.
+    size_t queueFiles = 0; // 0 = 2 * jobs
+    // Skip files the ingest manifest already has with the same size and
+    // mtime (or, if only the mtime moved, the same content hash).
+    bool useManifest = true;
+    // No "Обработка: <file>" line per file.
+    bool quiet = false;
+    // Receives per-file stage times and counts when given.
+    IngestMetrics* metrics = nullptr;
+};
+
+// Parse `files` and store their records through `db`. Files are written in
+// the order given regardless of `jobs`, so the database ends up the same as
+// with the serial loop. Only the writer thread touches `db` and, if given,
+// `segments`, which receives the batches of successful writes and is
+// flushed right before each commit of `db`; a failed segment flush rolls
+// the commit back, so its files are ingested again next time. Open `db`
+// with DbOptions::insertedOnly so the segments hold only the rows it
+// actually inserted. Prints per-stage throughput when done. Returns false
+// if any file could not be read, parsed or stored; the rest are still
+// ingested.
+bool ingestFiles(const std::vector<std::string>& files, DbWriter& db, const IngestOptions& opts,
+                 SegmentWriter* segments = nullptr);
+
+// True for file names the ingester accepts: *.xml and *.xml.gz.
+bool isPmFile(const std::string& path);
+
+// PM files directly inside `dir`, in directory order.
+std::vector<std::string> listPmFiles(const std::string& dir);
@@ -0,0 +1,101 @@
+#include "input_source.h"
+#include <filesystem>
+
+#ifdef ENIQ_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+FileSource::FileSource(const std::string& path) {
+    f_ = std::fopen(path.c_str(), "rb");
+    if (!f_) {
+        error_ = "File was not found";
+        return;
+    }
+    std::setvbuf(f_, nullptr, _IONBF, 0);
+}
+
+FileSource::~FileSource() {
+    if (f_) std::fclose(f_);
+}
+
+size_t FileSource::read(char* buf, size_t size) {
+    if (!f_) return 0;
+    size_t n = std::fread(buf, 1, size, f_);
+    if (n < size && std::ferror(f_)) error_ = "I/O error while reading file";
+
+    uint64_t h = hash_;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= static_cast<unsigned char>(buf[i]);
+        h *= 0x100000001b3ULL;
+    }
+    hash_ = h;
+    bytes_ += n;
+    return n;
+}
+
+bool hashFile(const std::string& path, uint64_t& hash) {
+    FileSource src(path);
+    if (!src.isOpen()) return false;
+    char buf[64 * 1024];
+    while (src.read(buf, sizeof buf) > 0) {}
+    hash = src.hash();
+    return !src.failed();
+}
+
+bool isGzipPath(const std::string& path) {
+    return std::filesystem::path(path).extension() == ".gz";
+}
+
+#ifdef ENIQ_HAVE_ZLIB
+
+GzipSource::GzipSource(FileSource& file) : file_(file), zs_(new z_stream()) {
+    // 15 + 16: zlib window size, expect a gzip header.
+    if (inflateInit2(zs_, 15 + 16) != Z_OK) {
+        error_ = "zlib initialization failed";
+        done_ = true;
+    }
+}
+
+GzipSource::~GzipSource() {
+    inflateEnd(zs_);
+    delete zs_;
+}
+
+size_t GzipSource::read(char* buf, size_t size) {
+    if (done_ || size == 0) return 0;
+    zs_->next_out = reinterpret_cast<Bytef*>(buf);
+    zs_->avail_out = static_cast<uInt>(size);
+
+    while (zs_->avail_out > 0) {
+        if (zs_->avail_in == 0) {
+            size_t n = file_.read(in_, sizeof in_);
+            if (n == 0) {
+                if (file_.failed()) error_ = file_.error();
+                else if (!memberEnded_) error_ = "Unexpected end of gzip stream";
+                done_ = true;
+                break;
+            }
+            zs_->next_in = reinterpret_cast<Bytef*>(in_);
+            zs_->avail_in = static_cast<uInt>(n);
+        }
+
+        const uInt outBefore = zs_->avail_out;
+        int rc = inflate(zs_, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            // Another member may follow, as produced by `cat a.gz b.gz`.
+            memberEnded_ = true;
+            inflateReset(zs_);
+            continue;
+        }
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            // Padding after the last member is ignored, as gzip does.
+            if (!memberEnded_) error_ = zs_->msg ? zs_->msg : "Corrupt gzip data";
+            done_ = true;
+            break;
+        }
+        if (zs_->avail_out != outBefore) memberEnded_ = false;
+    }
+    return size - zs_->avail_out;
+}
+
+#endif
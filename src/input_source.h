@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Forward-only byte stream feeding the XML reader.
+class ByteSource {
+public:
+    virtual ~ByteSource() = default;
+
+    // Reads up to `size` bytes into `buf`. Returns 0 at end of input or on
+    // error; check `failed()` to tell the two apart.
+    virtual size_t read(char* buf, size_t size) = 0;
+
+    bool failed() const { return !error_.empty(); }
+    const std::string& error() const { return error_; }
+
+protected:
+    std::string error_;
+};
+
+// Plain file read with stdio buffering disabled; the XML reader does its own
+// chunking so a second copy through the FILE buffer is wasted work. Keeps a
+// running FNV-1a hash of the bytes read for the ingest manifest.
+class FileSource : public ByteSource {
+public:
+    explicit FileSource(const std::string& path);
+    ~FileSource() override;
+
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+
+    bool isOpen() const { return f_ != nullptr; }
+    size_t read(char* buf, size_t size) override;
+
+    uint64_t bytesRead() const { return bytes_; }
+    uint64_t hash() const { return hash_; }
+
+private:
+    std::FILE* f_ = nullptr;
+    uint64_t bytes_ = 0;
+    uint64_t hash_ = 0xcbf29ce484222325ULL;
+};
+
+#ifdef ENIQ_HAVE_ZLIB
+struct z_stream_s;
+
+// Inflates gzip data read from `file` straight into the caller's buffer, so
+// a compressed PM file is parsed without a temporary copy on disk. Handles
+// files made of several concatenated gzip members.
+class GzipSource : public ByteSource {
+public:
+    explicit GzipSource(FileSource& file);
+    ~GzipSource() override;
+
+    GzipSource(const GzipSource&) = delete;
+    GzipSource& operator=(const GzipSource&) = delete;
+
+    size_t read(char* buf, size_t size) override;
+
+private:
+    FileSource& file_;
+    z_stream_s* zs_ = nullptr;
+    char in_[64 * 1024];
+    bool memberEnded_ = false;
+    bool done_ = false;
+};
+#endif
+
+// True for "*.gz" paths; those are decompressed on the fly.
+bool isGzipPath(const std::string& path);
+
+// FNV-1a of the whole file at `path`, matching FileSource::hash() after a
+// full read. Returns false if the file cannot be read.
+bool hashFile(const std::string& path, uint64_t& hash);
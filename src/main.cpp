@@ -1,42 +1,221 @@
-#include "xml_parser.h"
+#include "ingest.h"
 #include "db_writer.h"
+#include "dir_watch.h"
+#include "metrics.h"
+#include "segment_store.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 namespace fs = std::filesystem;
 
+static std::atomic<bool> g_stop{false};
+
+static void onSignal(int) {
+    g_stop = true;
+}
+
+// Whole argument as a number; anything else (including a sign for
+// unsigned types) is rejected instead of throwing like std::stoul.
+template <class T>
+static bool parseNumber(const char* s, T& out) {
+    const char* end = s + std::strlen(s);
+    auto res = std::from_chars(s, end, out);
+    return res.ec == std::errc() && res.ptr == end;
+}
+
+static void usage() {
+    std::cout << "Использование: eniq [опции] <путь_к_xml_или_папке>\n"
+                 "               eniq --build-rollups [опции] [путь]\n"
+                 "  --jobs N          число потоков разбора (0 = по числу ядер, по умолчанию 1)\n"
+                 "  --schema S        flat или normalized (словари + целочисленные ключи,\n"
+                 "                    pm_counters - представление со временем в UTC, без id)\n"
+                 "  --commit-batch N  строк в одной транзакции (по умолчанию 100000)\n"
+                 "  --journal MODE    PRAGMA journal_mode: WAL (по умолчанию), DELETE, TRUNCATE, PERSIST, MEMORY, OFF\n"
+                 "  --sync MODE       PRAGMA synchronous: OFF, NORMAL (по умолчанию), FULL, EXTRA\n"
+                 "  --cache-mb N      PRAGMA cache_size в МБ (по умолчанию 64)\n"
+                 "  --mmap-mb N       PRAGMA mmap_size в МБ (по умолчанию 256, 0 = выкл.)\n"
+                 "  --page-size N     PRAGMA page_size для новой БД\n"
+                 "  --rollups         создать агрегаты pm_rollup_hour/day и индекс для новой БД\n"
+                 "  --build-rollups   построить агрегаты и индекс по уже загруженным данным (долго)\n"
+                 "  --force           обрабатывать и уже загруженные файлы (без манифеста)\n"
+                 "  --watch           после загрузки папки ждать новые файлы (Ctrl+C для выхода)\n"
+                 "  --segments DIR    дополнительно писать колоночные сегменты (*.seg) по ROP в DIR\n"
+                 "  --quiet           без строк по каждому файлу, только итоги\n"
+                 "  --metrics-prom F  писать метрики по стадиям в F в текстовом формате Prometheus\n"
+                 "  --metrics-json F  дописывать в F строки JSON: по файлу и итоги (не stdout)\n"
+                 "  --metrics-interval S  период обновления метрик в секундах (по умолчанию 10)\n";
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cout << "Использование: eniq <путь_к_xml_или_папке>\n";
+    IngestOptions opts;
+    DbOptions dbOpts;
+    std::string path;
+    bool watch = false;
+    bool buildRollups = false;
+    std::string segmentDir;
+    std::string promPath, jsonPath;
+    double metricsInterval = 10.0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        bool bad = false;
+        if ((arg == "--jobs" || arg == "-j") && hasValue) {
+            bad = !parseNumber(argv[++i], opts.jobs);
+            if (opts.jobs == 0) opts.jobs = std::max(1u, std::thread::hardware_concurrency());
+        } else if (arg == "--schema" && hasValue) {
+            std::string schema = argv[++i];
+            if (schema == "flat") dbOpts.schema = DbSchema::Flat;
+            else if (schema == "normalized") dbOpts.schema = DbSchema::Normalized;
+            else {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--commit-batch" && hasValue) {
+            bad = !parseNumber(argv[++i], dbOpts.commitBatch);
+        } else if (arg == "--journal" && hasValue) {
+            dbOpts.journalMode = argv[++i];
+            bad = !isJournalMode(dbOpts.journalMode);
+        } else if (arg == "--sync" && hasValue) {
+            dbOpts.synchronous = argv[++i];
+            bad = !isSynchronousMode(dbOpts.synchronous);
+        } else if (arg == "--cache-mb" && hasValue) {
+            int mb = 0;
+            bad = !parseNumber(argv[++i], mb) || mb < 0 || mb > INT_MAX / 1024;
+            dbOpts.cacheSizeKb = mb * 1024;
+        } else if (arg == "--mmap-mb" && hasValue) {
+            int64_t mb = 0;
+            bad = !parseNumber(argv[++i], mb) || mb < 0 || mb > INT64_MAX / (1024 * 1024);
+            dbOpts.mmapSize = mb * 1024 * 1024;
+        } else if (arg == "--page-size" && hasValue) {
+            bad = !parseNumber(argv[++i], dbOpts.pageSize);
+        } else if (arg == "--rollups") {
+            dbOpts.rollups = true;
+        } else if (arg == "--build-rollups") {
+            buildRollups = true;
+        } else if (arg == "--force") {
+            opts.useManifest = false;
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--segments" && hasValue) {
+            segmentDir = argv[++i];
+        } else if (arg == "--quiet" || arg == "-q") {
+            opts.quiet = true;
+            dbOpts.quiet = true;
+        } else if (arg == "--metrics-prom" && hasValue) {
+            promPath = argv[++i];
+        } else if (arg == "--metrics-json" && hasValue) {
+            // stdout already carries the progress and summary lines.
+            jsonPath = argv[++i];
+            bad = jsonPath == "-";
+        } else if (arg == "--metrics-interval" && hasValue) {
+            bad = !parseNumber(argv[++i], metricsInterval) || !(metricsInterval > 0);
+        } else if (!arg.empty() && arg[0] == '-') {
+            usage();
+            return 1;
+        } else {
+            path = arg;
+        }
+        if (bad) {
+            std::cerr << "Некорректное значение " << arg << ": " << argv[i] << "\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (path.empty() && !buildRollups) {
+        usage();
         return 1;
     }
 
-    std::string path = argv[1];
-    std::vector<CounterRecord> all;
+    if (!path.empty() && !fs::is_directory(path) && !(fs::is_regular_file(path) && isPmFile(path))) {
+        std::cerr << "Не найден PM-файл или папка: " << path << "\n";
+        return 1;
+    }
 
     const std::string db = "eniq_data.db";
 
-    if (!initDatabase(db)) return 1;
+    // Segments must hold the same rows as the tables, re-sent files included.
+    dbOpts.insertedOnly = !segmentDir.empty();
+    // The backfill runs below, after open() has accepted a database with facts.
+    if (buildRollups) dbOpts.rollups = false;
+    DbWriter writer(dbOpts);
+    if (!writer.open(db)) return 1;
+    if (buildRollups) {
+        if (!writer.buildRollups()) return 1;
+        if (path.empty()) {
+            std::cout << "Агрегаты построены в " << db << "\n";
+            return 0;
+        }
+    }
+
+    if (watch && !fs::is_directory(path)) {
+        std::cerr << "--watch требует папку\n";
+        return 1;
+    }
+
+    std::unique_ptr<SegmentWriter> segments;
+    if (!segmentDir.empty()) {
+        SegmentOptions segOpts;
+        segOpts.quiet = opts.quiet;
+        segments = std::make_unique<SegmentWriter>(segmentDir, segOpts);
+    }
+
+    std::unique_ptr<IngestMetrics> metrics;
+    if (!promPath.empty() || !jsonPath.empty()) {
+        metrics = std::make_unique<IngestMetrics>();
+        if (!promPath.empty()) metrics->exportPrometheus(promPath);
+        if (!jsonPath.empty() && !metrics->exportJson(jsonPath)) return 1;
+        metrics->start(metricsInterval);
+        opts.metrics = metrics.get();
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    // Watch before the initial scan so files landing during it are not missed.
+    std::unique_ptr<DirWatcher> watcher;
+    if (watch) {
+        watcher = std::make_unique<DirWatcher>(path);
+        if (!watcher->ok()) return 1;
+    }
 
+    std::vector<std::string> files;
     if (fs::is_directory(path)) {
-        for (const auto& entry : fs::directory_iterator(path)) {
-            if (entry.is_regular_file() && entry.path().extension() == ".xml") {
-                std::cout << "Обработка: " << entry.path().filename() << "\n";
-                std::vector<CounterRecord> recs;
-                if (parse_ericsson_pm_xml(entry.path().string(), recs)) {
-                    saveRecords(db, recs);
-                    all.insert(all.end(), recs.begin(), recs.end());
-                }
-            }
-        }
-    } else if (fs::exists(path) && fs::path(path).extension() == ".xml") {
-        std::vector<CounterRecord> recs;
-        if (parse_ericsson_pm_xml(path, recs)) {
-            saveRecords(db, recs);
+        files = listPmFiles(path);
+    } else {
+        files.push_back(path);
+    }
+
+    bool ok = ingestFiles(files, writer, opts, segments.get());
+
+    if (watcher) {
+        std::cout << "Ожидание новых файлов в " << path << "\n";
+        while (!g_stop) {
+            files.clear();
+            watcher->wait(files, g_stop);
+            if (!files.empty() && !ingestFiles(files, writer, opts, segments.get())) ok = false;
         }
     }
 
+    writer.close();
+    if (metrics) metrics->stop();
+
+    if (!ok) {
+        std::cerr << "Загрузка завершена с ошибками\n";
+        return 1;
+    }
     std::cout << "Готово. Данные в " << db << "\n";
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,168 @@
+#include "metrics.h"
+#include <cstdio>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char* kStageNames[kStageCount] = {"read", "parse", "build", "dedupe", "insert", "commit"};
+
+int64_t unixNow() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// {"type":"file","file":"...","time":...,"read_s":...,...,"errors":0}
+std::string jsonLine(const char* type, const std::string* file, const IngestCounters& c) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(6) << "{\"type\":\"" << type << "\"";
+    if (file) out << ",\"file\":\"" << jsonEscape(*file) << "\"";
+    out << ",\"time\":" << unixNow();
+    for (size_t i = 0; i < kStageCount; ++i) out << ",\"" << kStageNames[i] << "_s\":" << c.seconds[i];
+    if (!file) out << ",\"files\":" << c.files << ",\"skipped\":" << c.skipped;
+    out << ",\"bytes\":" << c.bytes << ",\"records\":" << c.records << ",\"duplicates\":" << c.duplicates
+        << ",\"errors\":" << c.errors << "}\n";
+    return out.str();
+}
+
+std::string prometheusText(const IngestCounters& c) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(6);
+    out << "# HELP eniq_stage_seconds_total Time spent in each ingest stage.\n"
+           "# TYPE eniq_stage_seconds_total counter\n";
+    for (size_t i = 0; i < kStageCount; ++i)
+        out << "eniq_stage_seconds_total{stage=\"" << kStageNames[i] << "\"} " << c.seconds[i] << "\n";
+    auto counter = [&out](const char* name, const char* help, uint64_t v) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << v << "\n";
+    };
+    counter("eniq_files_total", "PM files parsed.", c.files);
+    counter("eniq_files_skipped_total", "PM files skipped as already ingested.", c.skipped);
+    counter("eniq_bytes_total", "Bytes read from PM files.", c.bytes);
+    counter("eniq_records_total", "Records parsed, duplicates included.", c.records);
+    counter("eniq_duplicates_total", "Records dropped by dedupe.", c.duplicates);
+    counter("eniq_errors_total", "Failed files and failed SQLite steps.", c.errors);
+    out << "# HELP eniq_metrics_timestamp_seconds When these metrics were written.\n"
+           "# TYPE eniq_metrics_timestamp_seconds gauge\n"
+           "eniq_metrics_timestamp_seconds " << unixNow() << "\n";
+    return out.str();
+}
+
+// Scrapers must never see a half-written file, so write aside and rename.
+bool replaceFile(const std::string& path, const std::string& content) {
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!(out << content) || !out.flush()) return false;
+    }
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    return !ec;
+}
+
+} // namespace
+
+const char* stageName(Stage s) {
+    return kStageNames[static_cast<size_t>(s)];
+}
+
+std::string jsonEscape(const std::string& s) {
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+void IngestCounters::merge(const IngestCounters& o) {
+    for (size_t i = 0; i < kStageCount; ++i) seconds[i] += o.seconds[i];
+    files += o.files;
+    skipped += o.skipped;
+    bytes += o.bytes;
+    records += o.records;
+    duplicates += o.duplicates;
+    errors += o.errors;
+}
+
+IngestMetrics::~IngestMetrics() {
+    stop();
+}
+
+bool IngestMetrics::exportJson(const std::string& path) {
+    json_.open(path, std::ios::binary | std::ios::app);
+    if (!json_) {
+        std::cerr << "Не удалось открыть файл метрик " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+void IngestMetrics::start(double intervalSeconds) {
+    if (reporter_.joinable() || (promPath_.empty() && !json_.is_open())) return;
+    const auto interval = std::chrono::duration<double>(intervalSeconds > 0 ? intervalSeconds : 10.0);
+    reporter_ = std::thread([this, interval] {
+        std::unique_lock<std::mutex> lk(m_);
+        while (!wake_.wait_for(lk, interval, [this] { return stopping_; })) {
+            lk.unlock();
+            report();
+            lk.lock();
+        }
+    });
+}
+
+void IngestMetrics::stop() {
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        if (stopping_) return;
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (reporter_.joinable()) reporter_.join();
+    report();
+}
+
+// Runs on the reporter thread, or in stop() once it has exited, so the
+// files are only ever written from one thread and never under m_.
+void IngestMetrics::report() {
+    IngestCounters c;
+    std::string lines;
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        c = totals_;
+        lines.swap(jsonPending_);
+    }
+    if (!promPath_.empty() && !replaceFile(promPath_, prometheusText(c)))
+        std::cerr << "Не удалось записать метрики в " << promPath_ << "\n";
+    if (json_.is_open()) json_ << lines << jsonLine("total", nullptr, c) << std::flush;
+}
+
+void IngestMetrics::addFile(const std::string& path, const IngestCounters& file) {
+    std::string line = json_.is_open() ? jsonLine("file", &path, file) : std::string();
+    std::lock_guard<std::mutex> lk(m_);
+    totals_.merge(file);
+    jsonPending_ += line;
+}
+
+void IngestMetrics::add(const IngestCounters& c) {
+    std::lock_guard<std::mutex> lk(m_);
+    totals_.merge(c);
+}
+
+IngestCounters IngestMetrics::totals() const {
+    std::lock_guard<std::mutex> lk(m_);
+    return totals_;
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Where ingest time goes. Read is disk I/O and gzip inflate, Parse the XML
+// tokenizer and PM walk, Build turning measValues into interned records,
+// Insert binding and stepping the INSERTs (manifest and rollup bookkeeping
+// included) and Commit the COMMITs together with their rollup upserts.
+enum class Stage { Read, Parse, Build, Dedupe, Insert, Commit };
+constexpr size_t kStageCount = 6;
+
+// "read", "parse", ... as used in the exported metric labels.
+const char* stageName(Stage s);
+
+// `s` with quotes, backslashes and control characters escaped for a JSON
+// string; the surrounding quotes are left to the caller.
+std::string jsonEscape(const std::string& s);
+
+struct IngestCounters {
+    double seconds[kStageCount] = {};
+    uint64_t files = 0;
+    uint64_t skipped = 0;    // unchanged according to the manifest
+    uint64_t bytes = 0;
+    uint64_t records = 0;    // parsed, duplicates included
+    uint64_t duplicates = 0; // dropped by the in-batch dedupe
+    uint64_t errors = 0;     // files that failed to parse or store, failed sqlite3_step calls
+
+    double& operator[](Stage s) { return seconds[static_cast<size_t>(s)]; }
+    double operator[](Stage s) const { return seconds[static_cast<size_t>(s)]; }
+    void merge(const IngestCounters& o);
+};
+
+// Adds the time until destruction to *seconds; does nothing for nullptr.
+class StageTimer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit StageTimer(double* seconds) : seconds_(seconds) {
+        if (seconds_) t0_ = Clock::now();
+    }
+    ~StageTimer() {
+        if (seconds_) *seconds_ += std::chrono::duration<double>(Clock::now() - t0_).count();
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    double* seconds_;
+    Clock::time_point t0_;
+};
+
+// Totals of a run, fed once per file by the ingest writer thread and
+// exported from a background thread: as a Prometheus text file rewritten
+// in place (for node_exporter's textfile collector) and/or as JSON lines,
+// one per stored file plus one with the totals every interval.
+class IngestMetrics {
+public:
+    IngestMetrics() = default;
+    ~IngestMetrics();
+
+    IngestMetrics(const IngestMetrics&) = delete;
+    IngestMetrics& operator=(const IngestMetrics&) = delete;
+
+    // Rewrites `path` with the totals on every report. Call before start().
+    void exportPrometheus(const std::string& path) { promPath_ = path; }
+
+    // Appends JSON lines to `path`. Returns false if it cannot be opened.
+    // Call before start().
+    bool exportJson(const std::string& path);
+
+    // Writes the totals every `intervalSeconds` until stop().
+    void start(double intervalSeconds);
+
+    // Stops the background thread and writes the final totals.
+    void stop();
+
+    // Adds one file's numbers to the totals. Its JSON line is only queued
+    // here and written with the next report, off the caller's thread.
+    void addFile(const std::string& path, const IngestCounters& file);
+
+    // Adds work not tied to a file, such as the final commit.
+    void add(const IngestCounters& c);
+
+    IngestCounters totals() const;
+
+private:
+    void report();
+
+    mutable std::mutex m_;
+    IngestCounters totals_;
+    std::string promPath_;
+    std::ofstream json_;
+    std::string jsonPending_; // file lines not yet written, guarded by m_
+
+    std::condition_variable wake_;
+    std::thread reporter_;
+    bool stopping_ = false;
+};
@@ -0,0 +1,26 @@
+#include "pm_sql.h"
+#include "pm_time.h"
+#include <sqlite3.h>
+#include <cstdint>
+#include <string_view>
+
+namespace {
+
+void pmEpoch(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    const unsigned char* text = sqlite3_value_text(argv[0]);
+    int64_t epoch;
+    if (!text || !parsePmTimestamp(std::string_view(reinterpret_cast<const char*>(text),
+                                                    static_cast<size_t>(sqlite3_value_bytes(argv[0]))),
+                                   epoch)) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    sqlite3_result_int64(ctx, epoch);
+}
+
+} // namespace
+
+bool registerPmFunctions(sqlite3* db) {
+    return sqlite3_create_function(db, "pm_epoch", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, pmEpoch, nullptr,
+                                   nullptr) == SQLITE_OK;
+}
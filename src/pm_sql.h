@@ -0,0 +1,9 @@
+#pragma once
+
+struct sqlite3;
+
+// Registers pm_epoch(text) on `db`: parsePmTimestamp() as an SQL function,
+// NULL for text it rejects. SQL that needs epoch seconds from the flat
+// schema's timestamp text uses it instead of strftime('%s', ...), which
+// does not accept +HHMM offsets, so C++ and SQL agree on every row.
+bool registerPmFunctions(sqlite3* db);
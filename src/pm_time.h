@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Parse a PM file timestamp such as beginTime="2026-02-10T00:15:00+01:00"
+// into seconds since the Unix epoch (UTC). Accepts 'T' or ' ' between date
+// and time, optional fractional seconds (dropped) and a 'Z', +HH:MM or
+// +HHMM offset; no offset means UTC. Returns false on anything else.
+bool parsePmTimestamp(std::string_view s, int64_t& epoch);
+
+// Format `epoch` as "YYYY-MM-DDTHH:MM:SSZ".
+std::string formatPmTimestamp(int64_t epoch);
@@ -1,39 +1,425 @@
+#include "segment_store.h"
+#include "pm_sql.h"
+#include "pm_time.h"
 #include <sqlite3.h>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
 
-int main() {
-    sqlite3* db = nullptr;
-    if (sqlite3_open("eniq_data.db", &db) != SQLITE_OK) {
-        std::cerr << "Ошибка открытия eniq_data.db\n";
+static void usage() {
+    std::cout << "Использование: query_db [опции]\n"
+                 "Фильтры:\n"
+                 "  --counter NAME    только этот счётчик\n"
+                 "  --meas-type ID    только этот measInfoId\n"
+                 "  --mo-prefix P     только MO, чей LDN начинается с P\n"
+                 "  --from T          с момента T включительно (ISO 8601)\n"
+                 "  --to T            до момента T, не включая\n"
+                 "Агрегация (count/sum/avg/min/max):\n"
+                 "  --by K            группировать: time, mo, counter, meas_type (по умолчанию итог)\n"
+                 "  --interval I      шаг для --by time: hour или day (по умолчанию hour)\n"
+                 "  --top N           N групп с наибольшим значением --order\n"
+                 "  --order A         count, sum, avg, min или max (по умолчанию sum)\n"
+                 "Источник:\n"
+                 "  --db PATH         файл БД (по умолчанию eniq_data.db)\n"
+                 "  --source S        auto, raw, hour или day (по умолчанию auto: самые крупные\n"
+                 "                    агрегаты, с которыми совпадают границы --from/--to и шаг)\n"
+                 "  --segments DIR    считать по колоночным сегментам, без SQLite (без --by)\n"
+                 "  --sample N        вывести первые N записей pm_counters\n"
+                 "  --explain         показать SQL и план запроса\n";
+}
+
+namespace {
+
+const int64_t kHour = 3600, kDay = 86400;
+
+int querySegments(const std::string& dir, const ScanFilter& f) {
+    size_t segments = 0;
+    Aggregate a = scanSegments(dir, f, &segments);
+    std::cout << "segments: " << segments << "\n"
+              << "count: " << a.count << "\n";
+    if (a.count) {
+        std::cout << "sum: " << a.sum << "\n"
+                  << "avg: " << a.avg() << "\n"
+                  << "min: " << a.min << "\n"
+                  << "max: " << a.max << "\n";
+    }
+    return 0;
+}
+
+struct Options {
+    std::string db = "eniq_data.db";
+    ScanFilter filter;
+    std::string by;
+    std::string interval = "hour";
+    std::string order = "sum";
+    std::string source = "auto";
+    size_t top = 0;
+    size_t sample = 0;
+    bool explain = false;
+};
+
+// Whole argument as a count; false on anything else instead of throwing.
+bool parseCount(const char* s, size_t& out) {
+    const char* end = s + std::strlen(s);
+    auto res = std::from_chars(s, end, out);
+    return res.ec == std::errc() && res.ptr == end;
+}
+
+// Column expressions of one table shape, so the statement is assembled the
+// same way for raw facts and rollups in either schema.
+struct Source {
+    std::string table, from, ts, mo, measType, counter, count, sum, min, max;
+};
+
+struct Param {
+    bool text;
+    std::string s;
+    int64_t i;
+};
+
+bool hasTable(sqlite3* db, const char* name, std::string* type = nullptr) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT type FROM sqlite_master WHERE name = ?;", -1, &stmt, nullptr) != SQLITE_OK) {
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found && type) *type = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+bool aligned(int64_t t, int64_t width) {
+    if (t == INT64_MIN || t == INT64_MAX) return true;
+    return ((t % width) + width) % width == 0;
+}
+
+std::string floorTo(const std::string& expr, int64_t width) {
+    const std::string w = std::to_string(width);
+    return "(" + expr + " - ((" + expr + " % " + w + ") + " + w + ") % " + w + ")";
+}
+
+// The smallest string above every string starting with `prefix`, or empty
+// if there is none (all 0xFF bytes).
+std::string prefixEnd(std::string prefix) {
+    while (!prefix.empty()) {
+        unsigned char c = static_cast<unsigned char>(prefix.back());
+        if (c != 0xFF) {
+            prefix.back() = static_cast<char>(c + 1);
+            return prefix;
+        }
+        prefix.pop_back();
+    }
+    return prefix;
+}
+
+Source makeSource(bool normalized, const std::string& kind, const ScanFilter& filter) {
+    Source s;
+    const bool raw = kind == "raw";
+    s.table = raw ? (normalized ? "pm_value" : "pm_counters") : "pm_rollup_" + kind;
+    if (normalized) {
+        s.from = s.table + " f JOIN pm_mo m ON m.id = f.mo_id JOIN pm_meas_type t ON t.id = f.meas_type_id"
+                           " JOIN pm_counter c ON c.id = f.counter_id";
+        // With a counter and an MO prefix: the counter, then the MOs in the
+        // prefix range by name, then one key (or index) seek per MO. Without
+        // statistics SQLite would rather scan every MO of the counter.
+        if (!filter.counter.empty() && !filter.moPrefix.empty()) {
+            s.from = "pm_counter c CROSS JOIN pm_mo m CROSS JOIN " + s.table +
+                     " f ON f.counter_id = c.id AND f.mo_id = m.id JOIN pm_meas_type t ON t.id = f.meas_type_id";
+        }
+        s.ts = raw ? "f.ts" : "f.bucket";
+        s.mo = "m.name";
+        s.measType = "t.name";
+        s.counter = "c.name";
+    } else {
+        s.from = s.table;
+        s.ts = raw ? "pm_epoch(timestamp)" : "bucket";
+        s.mo = "mo_ldn";
+        s.measType = "meas_type";
+        s.counter = "counter_name";
+    }
+    if (raw) {
+        s.count = "count(*)";
+        s.sum = "sum(value)";
+        s.min = "min(value)";
+        s.max = "max(value)";
+    } else {
+        s.count = "sum(value_count)";
+        s.sum = "sum(value_sum)";
+        s.min = "min(value_min)";
+        s.max = "max(value_max)";
+    }
+    return s;
+}
+
+// Coarsest source that answers the query exactly: rollup buckets have to
+// tile both time bounds and the --by time step.
+std::string pickSource(const Options& o, bool rollups) {
+    if (o.source != "auto") return o.source;
+    if (!rollups) return "raw";
+    const bool byDay = o.by == "time" && o.interval == "day";
+    if ((o.by != "time" || byDay) && aligned(o.filter.from, kDay) && aligned(o.filter.to, kDay)) return "day";
+    if (aligned(o.filter.from, kHour) && aligned(o.filter.to, kHour)) return "hour";
+    return "raw";
+}
+
+std::string buildQuery(const Options& o, bool normalized, const Source& src, std::vector<Param>& params) {
+    const ScanFilter& f = o.filter;
+    std::vector<std::string> where;
+    if (!f.counter.empty()) {
+        where.push_back(src.counter + " = ?");
+        params.push_back({true, f.counter, 0});
+    }
+    if (!f.measType.empty()) {
+        where.push_back(src.measType + " = ?");
+        params.push_back({true, f.measType, 0});
+    }
+    if (!f.moPrefix.empty()) {
+        // A range rather than LIKE, so the key/index on the DN is used.
+        where.push_back(src.mo + " >= ?");
+        params.push_back({true, f.moPrefix, 0});
+        std::string end = prefixEnd(f.moPrefix);
+        if (!end.empty()) {
+            where.push_back(src.mo + " < ?");
+            params.push_back({true, end, 0});
+        }
+    }
+    const bool flatRaw = !normalized && src.table == "pm_counters";
+    if (f.from != INT64_MIN) {
+        // Flat rows keep the file's own text; offsets move it by less than a
+        // day, so the text range only narrows and the epoch test decides.
+        if (flatRaw) {
+            where.push_back("timestamp >= ?");
+            params.push_back({true, formatPmTimestamp(f.from - kDay), 0});
+        }
+        where.push_back(src.ts + " >= ?");
+        params.push_back({false, "", f.from});
+    }
+    if (f.to != INT64_MAX) {
+        if (flatRaw) {
+            where.push_back("timestamp < ?");
+            params.push_back({true, formatPmTimestamp(f.to + kDay), 0});
+        }
+        where.push_back(src.ts + " < ?");
+        params.push_back({false, "", f.to});
+    }
+
+    std::string key;
+    if (o.by == "time") key = floorTo(src.ts, o.interval == "day" ? kDay : kHour);
+    else if (o.by == "mo") key = src.mo;
+    else if (o.by == "counter") key = src.counter;
+    else if (o.by == "meas_type") key = src.measType;
+
+    std::string sql = "SELECT " + (key.empty() ? std::string("NULL") : key) + ", " + src.count + ", " + src.sum +
+                      ", " + src.min + ", " + src.max + " FROM " + src.from;
+    for (size_t i = 0; i < where.size(); ++i) sql += (i ? " AND " : " WHERE ") + where[i];
+    if (!key.empty()) {
+        sql += " GROUP BY 1";
+        if (o.top) {
+            const std::string order = o.order == "count" ? "2" : o.order == "min" ? "4" : o.order == "max" ? "5"
+                                    : o.order == "avg"   ? "3 / 2"
+                                                         : "3";
+            sql += " ORDER BY " + order + " DESC LIMIT " + std::to_string(o.top);
+        } else {
+            sql += " ORDER BY 1";
+        }
+    }
+    return sql + ";";
+}
+
+void bindParams(sqlite3_stmt* stmt, const std::vector<Param>& params) {
+    for (size_t i = 0; i < params.size(); ++i) {
+        const Param& p = params[i];
+        const int n = static_cast<int>(i + 1);
+        if (p.text) sqlite3_bind_text(stmt, n, p.s.data(), static_cast<int>(p.s.size()), SQLITE_STATIC);
+        else sqlite3_bind_int64(stmt, n, p.i);
+    }
+}
+
+void explain(sqlite3* db, const std::string& sql, const std::vector<Param>& params) {
+    std::cerr << sql << "\n";
+    sqlite3_stmt* stmt = nullptr;
+    std::string q = "EXPLAIN QUERY PLAN " + sql;
+    if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) return;
+    bindParams(stmt, params);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::cerr << "  " << reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)) << "\n";
+    }
+    sqlite3_finalize(stmt);
+}
+
+int sampleRows(sqlite3* db, size_t n) {
+    sqlite3_stmt* stmt = nullptr;
+    const char* q = "SELECT timestamp, mo_ldn, meas_type, counter_name, value FROM pm_counters LIMIT ?;";
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Ошибка запроса: " << sqlite3_errmsg(db) << "\n";
+        return 1;
+    }
+    sqlite3_bind_int64(stmt, 1, static_cast<int64_t>(n));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char* ts = sqlite3_column_text(stmt, 0);
+        const unsigned char* mo = sqlite3_column_text(stmt, 1);
+        const unsigned char* mt = sqlite3_column_text(stmt, 2);
+        const unsigned char* cn = sqlite3_column_text(stmt, 3);
+        double v = sqlite3_column_double(stmt, 4);
+        std::cout << (ts ? (const char*)ts : "NULL") << ", "
+                  << (mo ? (const char*)mo : "NULL") << ", "
+                  << (mt ? (const char*)mt : "NULL") << ", "
+                  << (cn ? (const char*)cn : "NULL") << ", " << v << "\n";
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+int queryDb(sqlite3* db, const Options& o) {
+    std::string type;
+    if (!hasTable(db, "pm_counters", &type)) {
+        std::cerr << "В БД нет данных PM\n";
+        return 1;
+    }
+    const bool normalized = type == "view";
+    const bool rollups = hasTable(db, "pm_rollup_hour");
+    const std::string kind = pickSource(o, rollups);
+    if (kind != "raw" && !rollups) {
+        std::cerr << "В БД нет агрегатов, используйте --source raw\n";
         return 1;
     }
 
+    std::vector<Param> params;
+    const Source src = makeSource(normalized, kind, o.filter);
+    const std::string sql = buildQuery(o, normalized, src, params);
+    if (o.explain) explain(db, sql, params);
+
+    auto t0 = std::chrono::steady_clock::now();
     sqlite3_stmt* stmt = nullptr;
-    const char* qcount = "SELECT COUNT(*) FROM pm_counters;";
-    if (sqlite3_prepare_v2(db, qcount, -1, &stmt, nullptr) == SQLITE_OK) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            int cnt = sqlite3_column_int(stmt, 0);
-            std::cout << "rows_count: " << cnt << "\n";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Ошибка запроса: " << sqlite3_errmsg(db) << "\n";
+        return 1;
+    }
+    bindParams(stmt, params);
+
+    std::cout << (o.by.empty() ? "" : o.by + "\t") << "count\tsum\tavg\tmin\tmax\n";
+    size_t rows = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const int64_t count = sqlite3_column_int64(stmt, 1);
+        if (count == 0) continue; // total over no rows
+        if (o.by == "time") {
+            std::cout << formatPmTimestamp(sqlite3_column_int64(stmt, 0)) << "\t";
+        } else if (!o.by.empty()) {
+            const unsigned char* k = sqlite3_column_text(stmt, 0);
+            std::cout << (k ? (const char*)k : "NULL") << "\t";
         }
-        sqlite3_finalize(stmt);
+        const double sum = sqlite3_column_double(stmt, 2);
+        std::cout << count << "\t" << sum << "\t" << sum / count << "\t" << sqlite3_column_double(stmt, 3) << "\t"
+                  << sqlite3_column_double(stmt, 4) << "\n";
+        ++rows;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        std::cerr << "Ошибка запроса: " << sqlite3_errmsg(db) << "\n";
+        return 1;
     }
 
-    const char* q = "SELECT timestamp, mo_ldn, meas_type, counter_name, value FROM pm_counters LIMIT 10;";
-    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char* ts = sqlite3_column_text(stmt, 0);
-            const unsigned char* mo = sqlite3_column_text(stmt, 1);
-            const unsigned char* mt = sqlite3_column_text(stmt, 2);
-            const unsigned char* cn = sqlite3_column_text(stmt, 3);
-            double v = sqlite3_column_double(stmt, 4);
-            std::cout << (ts ? (const char*)ts : "NULL") << ", "
-                      << (mo ? (const char*)mo : "NULL") << ", "
-                      << (mt ? (const char*)mt : "NULL") << ", "
-                      << (cn ? (const char*)cn : "NULL") << ", " << v << "\n";
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << rows << " строк из " << src.table << " за " << ms << " мс\n";
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options o;
+    std::string segmentDir;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--segments" && hasValue) {
+            segmentDir = argv[++i];
+        } else if (arg == "--db" && hasValue) {
+            o.db = argv[++i];
+        } else if (arg == "--counter" && hasValue) {
+            o.filter.counter = argv[++i];
+        } else if (arg == "--meas-type" && hasValue) {
+            o.filter.measType = argv[++i];
+        } else if (arg == "--mo-prefix" && hasValue) {
+            o.filter.moPrefix = argv[++i];
+        } else if ((arg == "--from" || arg == "--to") && hasValue) {
+            int64_t t;
+            if (!parsePmTimestamp(argv[++i], t)) {
+                std::cerr << "Некорректное время: " << argv[i] << "\n";
+                return 1;
+            }
+            (arg == "--from" ? o.filter.from : o.filter.to) = t;
+        } else if (arg == "--by" && hasValue) {
+            o.by = argv[++i];
+            if (o.by != "time" && o.by != "mo" && o.by != "counter" && o.by != "meas_type") {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--interval" && hasValue) {
+            o.interval = argv[++i];
+            if (o.interval != "hour" && o.interval != "day") {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--order" && hasValue) {
+            o.order = argv[++i];
+            if (o.order != "count" && o.order != "sum" && o.order != "avg" && o.order != "min" && o.order != "max") {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--top" && hasValue) {
+            if (!parseCount(argv[++i], o.top)) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--source" && hasValue) {
+            o.source = argv[++i];
+            if (o.source != "auto" && o.source != "raw" && o.source != "hour" && o.source != "day") {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--sample" && hasValue) {
+            if (!parseCount(argv[++i], o.sample)) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--explain") {
+            o.explain = true;
+        } else {
+            usage();
+            return 1;
         }
-        sqlite3_finalize(stmt);
+    }
+    if (!segmentDir.empty()) {
+        if (!o.by.empty()) {
+            usage();
+            return 1;
+        }
+        return querySegments(segmentDir, o.filter);
+    }
+    if (o.top && (o.by.empty() || o.by == "time")) {
+        std::cerr << "--top требует --by mo, counter или meas_type\n";
+        return 1;
     }
 
+    sqlite3* db = nullptr;
+    if (sqlite3_open_v2(o.db.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        std::cerr << "Ошибка открытия " << o.db << "\n";
+        sqlite3_close(db);
+        return 1;
+    }
+    if (!registerPmFunctions(db)) {
+        std::cerr << "Ошибка регистрации функций SQL: " << sqlite3_errmsg(db) << "\n";
+        sqlite3_close(db);
+        return 1;
+    }
+    int rc = o.sample ? sampleRows(db, o.sample) : queryDb(db, o);
     sqlite3_close(db);
-    return 0;
+    return rc;
 }
@@ -0,0 +1,114 @@
+#include "record_batch.h"
+#include "xml_parser.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+inline uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Eight bytes at a time; DNs and counter names are short so this beats a
+// byte-wise FNV loop without pulling in a hashing library.
+uint64_t hashBytes(const char* p, size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ n;
+    while (n >= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ mix(w)) * 0x100000001b3ULL;
+        p += 8;
+        n -= 8;
+    }
+    uint64_t w = 0;
+    std::memcpy(&w, p, n);
+    return mix(h ^ w);
+}
+
+} // namespace
+
+void StringPool::clear() {
+    data_.clear();
+    spans_.clear();
+    hashes_.clear();
+    std::fill(slots_.begin(), slots_.end(), 0u);
+}
+
+void StringPool::grow() {
+    std::vector<uint32_t> slots(slots_.empty() ? 256 : slots_.size() * 2, 0u);
+    const size_t mask = slots.size() - 1;
+    for (uint32_t id = 0; id < spans_.size(); ++id) {
+        size_t i = hashes_[id] & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+    slots_.swap(slots);
+}
+
+uint32_t StringPool::intern(std::string_view s) {
+    // Keep the load factor under one half.
+    if ((spans_.size() + 1) * 2 > slots_.size()) grow();
+
+    const uint64_t h = hashBytes(s.data(), s.size());
+    const size_t mask = slots_.size() - 1;
+    size_t i = h & mask;
+    while (uint32_t slot = slots_[i]) {
+        const uint32_t id = slot - 1;
+        if (hashes_[id] == h && view(id) == s) return id;
+        i = (i + 1) & mask;
+    }
+
+    const uint32_t id = static_cast<uint32_t>(spans_.size());
+    spans_.push_back({static_cast<uint32_t>(data_.size()), static_cast<uint32_t>(s.size())});
+    hashes_.push_back(h);
+    data_.append(s.data(), s.size());
+    slots_[i] = id + 1;
+    return id;
+}
+
+void RecordKeySet::clear(size_t expected) {
+    size_t cap = 16;
+    while (cap < expected * 2) cap *= 2;
+    // Capacity is kept, so after the first large batch this only zeroes.
+    slots_.resize(cap);
+    used_.assign(cap, 0);
+}
+
+bool RecordKeySet::insert(const PmRecord& r) {
+    const size_t mask = slots_.size() - 1;
+    const uint64_t a = (static_cast<uint64_t>(r.timestamp) << 32) | r.mo;
+    const uint64_t b = (static_cast<uint64_t>(r.measType) << 32) | r.counter;
+    size_t i = mix(a * 0x9E3779B97F4A7C15ULL ^ b) & mask;
+    while (used_[i]) {
+        const Key& k = slots_[i];
+        if (k.timestamp == r.timestamp && k.mo == r.mo && k.measType == r.measType && k.counter == r.counter) {
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    used_[i] = 1;
+    slots_[i] = {r.timestamp, r.mo, r.measType, r.counter};
+    return true;
+}
+
+void RecordBatch::add(const CounterRecord& r) {
+    records.push_back({strings.intern(r.timestamp), strings.intern(r.mo_ldn), strings.intern(r.meas_type),
+                       strings.intern(r.counter_name), r.value});
+}
+
+size_t RecordBatch::dedupe() {
+    // Sized for the whole batch up front, so the set never rehashes.
+    seen_.clear(records.size());
+    size_t out = 0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (seen_.insert(records[i])) records[out++] = records[i];
+    }
+    const size_t dropped = records.size() - out;
+    records.resize(out);
+    return dropped;
+}
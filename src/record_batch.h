@@ -0,0 +1,82 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct CounterRecord;
+
+// Distinct strings of one batch stored back to back in a single arena and
+// addressed by a dense 32-bit id. Interning an already known string costs a
+// hash probe and no allocation; clear() keeps all capacity for reuse.
+class StringPool {
+public:
+    uint32_t intern(std::string_view s);
+
+    // Valid until the next intern() or clear().
+    std::string_view view(uint32_t id) const {
+        return std::string_view(data_.data() + spans_[id].offset, spans_[id].length);
+    }
+
+    size_t size() const { return spans_.size(); }
+    void clear();
+
+private:
+    struct Span {
+        uint32_t offset, length;
+    };
+
+    void grow();
+
+    std::string data_;
+    std::vector<Span> spans_;
+    std::vector<uint64_t> hashes_;
+    std::vector<uint32_t> slots_; // id + 1, 0 = empty
+};
+
+// One parsed record as four pool ids and the value: 24 bytes, no strings.
+struct PmRecord {
+    uint32_t timestamp;
+    uint32_t mo;
+    uint32_t measType;
+    uint32_t counter;
+    double value;
+};
+
+// Open-addressing set of (timestamp, mo, measType, counter) id tuples. Ids
+// are unique per string within a pool, so the tuple is an exact key.
+class RecordKeySet {
+public:
+    // Returns true if `r`'s key was not in the set yet.
+    bool insert(const PmRecord& r);
+    void clear(size_t expected);
+
+private:
+    struct Key {
+        uint32_t timestamp, mo, measType, counter;
+    };
+
+    std::vector<Key> slots_;
+    std::vector<uint8_t> used_;
+};
+
+// The records of one file (or several) together with the strings they use.
+struct RecordBatch {
+    StringPool strings;
+    std::vector<PmRecord> records;
+
+    void clear() {
+        strings.clear();
+        records.clear();
+    }
+
+    void add(const CounterRecord& r);
+
+    // Drops records whose key already occurred earlier in the batch, keeping
+    // the first one, and returns how many were dropped.
+    size_t dedupe();
+
+private:
+    RecordKeySet seen_;
+};
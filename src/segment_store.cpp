@@ -0,0 +1,562 @@
+#include "segment_store.h"
+#include "record_batch.h"
+#include "pm_time.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <system_error>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char kMagic[8] = {'E', 'N', 'I', 'Q', 'S', 'E', 'G', '1'};
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kByteOrder = 0x01020304;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t rows;
+    uint64_t footerOffset;
+};
+static_assert(sizeof(FileHeader) == 32, "segment header layout");
+
+struct DictDesc {
+    uint64_t offsetsOffset; // uint32_t[count + 1]
+    uint64_t charsOffset;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct FileFooter {
+    int64_t tsBase, tsMin, tsMax;
+    uint64_t valueOffset, tsDeltaOffset, moOffset, measTypeOffset, counterStartOffset;
+    DictDesc mos, measTypes, counters;
+};
+static_assert(sizeof(FileFooter) == 136, "segment footer layout");
+
+int64_t floorDiv(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+// "2026-02-10T00:15:00Z" -> "20260210T001500Z" for file names.
+std::string compactTime(int64_t epoch) {
+    std::string s = formatPmTimestamp(epoch);
+    s.erase(std::remove_if(s.begin(), s.end(), [](char c) { return c == '-' || c == ':'; }), s.end());
+    return s;
+}
+
+// Sorts `names` and returns old id -> new id.
+std::vector<uint32_t> sortNames(std::vector<std::string>& names) {
+    std::vector<uint32_t> order(names.size());
+    std::iota(order.begin(), order.end(), 0u);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return names[a] < names[b]; });
+
+    std::vector<uint32_t> rank(names.size());
+    std::vector<std::string> sorted(names.size());
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        rank[order[i]] = i;
+        sorted[i] = std::move(names[order[i]]);
+    }
+    names.swap(sorted);
+    return rank;
+}
+
+class SegmentFile {
+public:
+    explicit SegmentFile(const std::string& path) : out_(path, std::ios::binary | std::ios::trunc) {}
+
+    bool ok() const { return static_cast<bool>(out_); }
+    uint64_t offset() const { return offset_; }
+
+    void put(const void* p, size_t n) {
+        out_.write(static_cast<const char*>(p), static_cast<std::streamsize>(n));
+        offset_ += n;
+    }
+
+    template <class T>
+    uint64_t column(const std::vector<T>& v) {
+        align();
+        const uint64_t at = offset_;
+        put(v.data(), v.size() * sizeof(T));
+        return at;
+    }
+
+    DictDesc dict(const std::vector<std::string>& names) {
+        std::vector<uint32_t> offsets;
+        offsets.reserve(names.size() + 1);
+        uint32_t pos = 0;
+        for (const auto& n : names) {
+            offsets.push_back(pos);
+            pos += static_cast<uint32_t>(n.size());
+        }
+        offsets.push_back(pos);
+
+        DictDesc d{};
+        d.count = static_cast<uint32_t>(names.size());
+        d.offsetsOffset = column(offsets);
+        d.charsOffset = offset_;
+        for (const auto& n : names) put(n.data(), n.size());
+        return d;
+    }
+
+    // Overwrites bytes already written at `at`.
+    void patch(uint64_t at, const void* p, size_t n) {
+        out_.seekp(static_cast<std::streamoff>(at));
+        out_.write(static_cast<const char*>(p), static_cast<std::streamsize>(n));
+        out_.seekp(0, std::ios::end);
+    }
+
+    bool close() {
+        out_.close();
+        return !out_.fail();
+    }
+
+    void align() {
+        static const char zeros[8] = {};
+        if (offset_ % 8) put(zeros, 8 - offset_ % 8);
+    }
+
+private:
+    std::ofstream out_;
+    uint64_t offset_ = 0;
+};
+
+} // namespace
+
+uint32_t SegmentWriter::Dict::id(std::string_view name) {
+    auto it = ids.find(std::string(name));
+    if (it != ids.end()) return it->second;
+    const uint32_t id = static_cast<uint32_t>(names.size());
+    names.emplace_back(name);
+    ids.emplace(names.back(), id);
+    return id;
+}
+
+SegmentWriter::SegmentWriter(std::string dir, SegmentOptions opts) : dir_(std::move(dir)), opts_(opts) {
+    if (opts_.windowSeconds <= 0) opts_.windowSeconds = 900;
+}
+
+bool SegmentWriter::write(const RecordBatch& batch) {
+    const StringPool& s = batch.strings;
+    const int64_t unparsed = INT64_MIN, invalid = INT64_MIN + 1;
+    tsMap_.assign(s.size(), unparsed);
+
+    // A file normally covers one ROP, so this is a single window; the
+    // per-window id maps are rebuilt for each window present.
+    std::vector<int64_t> starts;
+    for (const PmRecord& r : batch.records) {
+        int64_t& ts = tsMap_[r.timestamp];
+        if (ts == unparsed) {
+            if (!parsePmTimestamp(s.view(r.timestamp), ts)) ts = invalid;
+            else starts.push_back(floorDiv(ts, opts_.windowSeconds) * opts_.windowSeconds);
+        }
+    }
+    std::sort(starts.begin(), starts.end());
+    starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+
+    for (int64_t start : starts) {
+        Window& w = windows_[start];
+        for (auto* map : {&moMap_, &measTypeMap_, &counterMap_}) map->assign(s.size(), UINT32_MAX);
+        auto mapId = [&s](Dict& d, std::vector<uint32_t>& map, uint32_t id) {
+            if (map[id] == UINT32_MAX) map[id] = d.id(s.view(id));
+            return map[id];
+        };
+
+        for (const PmRecord& r : batch.records) {
+            const int64_t ts = tsMap_[r.timestamp];
+            if (ts == invalid || ts < start || ts - start >= opts_.windowSeconds) continue;
+            Row row;
+            row.counter = mapId(w.counters, counterMap_, r.counter);
+            row.mo = mapId(w.mos, moMap_, r.mo);
+            row.measType = mapId(w.measTypes, measTypeMap_, r.measType);
+            row.tsDelta = static_cast<uint32_t>(ts - start);
+            row.value = r.value;
+            w.rows.push_back(row);
+            ++buffered_;
+        }
+    }
+
+    if (buffered_ >= opts_.maxBufferedRows) return flush();
+    return true;
+}
+
+bool SegmentWriter::flush() {
+    if (windows_.empty()) return true;
+
+    std::error_code ec;
+    fs::create_directories(dir_, ec);
+    const bool haveDir = !ec;
+    if (!haveDir) std::cerr << "Ошибка сегментов: не удалось создать папку " << dir_ << ": " << ec.message() << "\n";
+
+    bool ok = haveDir;
+    for (auto& [start, w] : windows_) {
+        if (haveDir && !w.rows.empty() && !writeWindow(start, w)) ok = false;
+    }
+    windows_.clear();
+    buffered_ = 0;
+    return ok;
+}
+
+bool SegmentWriter::writeWindow(int64_t start, Window& w) {
+    const std::vector<uint32_t> moRank = sortNames(w.mos.names);
+    const std::vector<uint32_t> typeRank = sortNames(w.measTypes.names);
+    const std::vector<uint32_t> counterRank = sortNames(w.counters.names);
+    for (Row& r : w.rows) {
+        r.mo = moRank[r.mo];
+        r.measType = typeRank[r.measType];
+        r.counter = counterRank[r.counter];
+    }
+    std::sort(w.rows.begin(), w.rows.end(), [](const Row& a, const Row& b) {
+        if (a.counter != b.counter) return a.counter < b.counter;
+        if (a.mo != b.mo) return a.mo < b.mo;
+        if (a.tsDelta != b.tsDelta) return a.tsDelta < b.tsDelta;
+        return a.measType < b.measType;
+    });
+
+    const size_t n = w.rows.size();
+    std::vector<double> value(n);
+    std::vector<uint32_t> tsDelta(n), mo(n), measType(n);
+    std::vector<uint64_t> counterStart(w.counters.names.size() + 1, 0);
+    uint32_t dMin = UINT32_MAX, dMax = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const Row& r = w.rows[i];
+        value[i] = r.value;
+        tsDelta[i] = r.tsDelta;
+        mo[i] = r.mo;
+        measType[i] = r.measType;
+        ++counterStart[r.counter + 1];
+        dMin = std::min(dMin, r.tsDelta);
+        dMax = std::max(dMax, r.tsDelta);
+    }
+    std::partial_sum(counterStart.begin(), counterStart.end(), counterStart.begin());
+
+    // Never overwrite an existing segment: a later flush for the same
+    // window (next run, --watch) gets the next sequence number.
+    const std::string stem = (fs::path(dir_) / ("pm_" + compactTime(start))).string();
+    std::string path;
+    for (unsigned seq = 0;; ++seq) {
+        path = stem + "_" + std::to_string(seq) + ".seg";
+        if (!fs::exists(path)) break;
+    }
+    const std::string tmp = path + ".tmp";
+
+    {
+        SegmentFile f(tmp);
+        if (!f.ok()) {
+            std::cerr << "Ошибка сегментов: не удалось открыть " << tmp << "\n";
+            return false;
+        }
+        FileHeader h{};
+        std::memcpy(h.magic, kMagic, sizeof(kMagic));
+        h.version = kVersion;
+        h.byteOrder = kByteOrder;
+        h.rows = n;
+        f.put(&h, sizeof(h)); // footerOffset is patched below
+
+        FileFooter ft{};
+        ft.tsBase = start;
+        ft.tsMin = start + dMin;
+        ft.tsMax = start + dMax;
+        ft.valueOffset = f.column(value);
+        ft.tsDeltaOffset = f.column(tsDelta);
+        ft.moOffset = f.column(mo);
+        ft.measTypeOffset = f.column(measType);
+        ft.mos = f.dict(w.mos.names);
+        ft.measTypes = f.dict(w.measTypes.names);
+        ft.counters = f.dict(w.counters.names);
+        ft.counterStartOffset = f.column(counterStart);
+        f.align();
+        h.footerOffset = f.offset();
+        f.put(&ft, sizeof(ft));
+        f.patch(0, &h, sizeof(h));
+        if (!f.ok() || !f.close()) {
+            std::cerr << "Ошибка сегментов: ошибка записи " << tmp << "\n";
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        std::cerr << "Ошибка сегментов: " << ec.message() << " (" << path << ")\n";
+        fs::remove(tmp, ec);
+        return false;
+    }
+    if (!opts_.quiet) std::cout << "Сегмент " << fs::path(path).filename().string() << ": " << n << " записей\n";
+    return true;
+}
+
+void Aggregate::merge(const Aggregate& o) {
+    count += o.count;
+    sum += o.sum;
+    min = std::min(min, o.min);
+    max = std::max(max, o.max);
+}
+
+SegmentReader::~SegmentReader() {
+    close();
+}
+
+void SegmentReader::close() {
+#ifdef _WIN32
+    if (base_) UnmapViewOfFile(base_);
+    if (mapping_) CloseHandle(static_cast<HANDLE>(mapping_));
+    if (file_) CloseHandle(static_cast<HANDLE>(file_));
+    mapping_ = nullptr;
+    file_ = nullptr;
+#else
+    if (base_) munmap(const_cast<char*>(base_), size_);
+#endif
+    base_ = nullptr;
+    size_ = 0;
+    rows_ = 0;
+}
+
+bool SegmentReader::open(const std::string& path) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::cerr << "Ошибка сегмента: не удалось открыть " << path << "\n";
+        return false;
+    }
+    file_ = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        std::cerr << "Ошибка сегмента: пустой файл " << path << "\n";
+        close();
+        return false;
+    }
+    mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_) base_ = static_cast<const char*>(MapViewOfFile(static_cast<HANDLE>(mapping_), FILE_MAP_READ, 0, 0, 0));
+    if (!base_) {
+        std::cerr << "Ошибка сегмента: не удалось отобразить " << path << "\n";
+        close();
+        return false;
+    }
+    size_ = static_cast<size_t>(size.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Ошибка сегмента: не удалось открыть " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "Ошибка сегмента: пустой файл " << path << "\n";
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "Ошибка сегмента: mmap " << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    base_ = static_cast<const char*>(p);
+    size_ = static_cast<size_t>(st.st_size);
+#endif
+
+    auto fail = [&](const char* why) {
+        std::cerr << "Ошибка сегмента: " << why << " в файле " << path << "\n";
+        close();
+        return false;
+    };
+
+    FileHeader h;
+    if (size_ < sizeof(h)) return fail("файл короче заголовка");
+    std::memcpy(&h, base_, sizeof(h));
+    if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0) return fail("неизвестный формат");
+    if (h.version != kVersion) return fail("неподдерживаемая версия");
+    if (h.byteOrder != kByteOrder) return fail("другой порядок байт");
+    if (h.footerOffset % 8 || h.footerOffset > size_ || size_ - h.footerOffset < sizeof(FileFooter)) {
+        return fail("повреждённый футер");
+    }
+    FileFooter ft;
+    std::memcpy(&ft, base_ + h.footerOffset, sizeof(ft));
+
+    // Every array has to lie inside the file, before the footer, and be
+    // aligned for its element type.
+    auto inside = [&](uint64_t off, uint64_t count, uint64_t elem) {
+        return off % elem == 0 && off <= h.footerOffset && count <= (h.footerOffset - off) / elem;
+    };
+    const uint64_t n = h.rows;
+    if (!inside(ft.valueOffset, n, 8) || !inside(ft.tsDeltaOffset, n, 4) || !inside(ft.moOffset, n, 4) ||
+        !inside(ft.measTypeOffset, n, 4)) {
+        return fail("повреждённые колонки");
+    }
+
+    auto loadDict = [&](const DictDesc& d, DictView& out) {
+        if (!inside(d.offsetsOffset, uint64_t(d.count) + 1, 4)) return false;
+        out.count = d.count;
+        out.offsets = reinterpret_cast<const uint32_t*>(base_ + d.offsetsOffset);
+        out.chars = base_ + d.charsOffset;
+        if (out.offsets[0] != 0) return false;
+        for (uint32_t i = 0; i < d.count; ++i) {
+            if (out.offsets[i + 1] < out.offsets[i]) return false;
+        }
+        return inside(d.charsOffset, out.offsets[d.count], 1);
+    };
+    if (!loadDict(ft.mos, mos_) || !loadDict(ft.measTypes, measTypes_) || !loadDict(ft.counters, counters_)) {
+        return fail("повреждённый словарь");
+    }
+
+    if (!inside(ft.counterStartOffset, uint64_t(counters_.count) + 1, 8)) return fail("повреждённый индекс");
+    counterStart_ = reinterpret_cast<const uint64_t*>(base_ + ft.counterStartOffset);
+    if (counterStart_[0] != 0 || counterStart_[counters_.count] != n) return fail("повреждённый индекс");
+    for (uint32_t c = 0; c < counters_.count; ++c) {
+        if (counterStart_[c + 1] < counterStart_[c]) return fail("повреждённый индекс");
+    }
+
+    rows_ = n;
+    tsBase_ = ft.tsBase;
+    tsMin_ = ft.tsMin;
+    tsMax_ = ft.tsMax;
+    value_ = reinterpret_cast<const double*>(base_ + ft.valueOffset);
+    tsDelta_ = reinterpret_cast<const uint32_t*>(base_ + ft.tsDeltaOffset);
+    mo_ = reinterpret_cast<const uint32_t*>(base_ + ft.moOffset);
+    measType_ = reinterpret_cast<const uint32_t*>(base_ + ft.measTypeOffset);
+    return true;
+}
+
+uint32_t SegmentReader::DictView::lowerBound(std::string_view s) const {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (name(mid) < s) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// The hot loop: selection is computed without branches so the compiler can
+// keep it vectorised. MO filtering has already been turned into [b, e).
+void SegmentReader::scanRange(uint64_t b, uint64_t e, uint32_t moLo, uint32_t moHi, int64_t measType,
+                              uint32_t tsLo, uint32_t tsHi, Aggregate& out) const {
+    if (moLo != 0 || moHi != mos_.count) {
+        b = std::lower_bound(mo_ + b, mo_ + e, moLo) - mo_;
+        e = std::lower_bound(mo_ + b, mo_ + e, moHi) - mo_;
+    }
+    if (b >= e) return;
+
+    uint64_t count = 0;
+    double sum = 0.0, mn = out.min, mx = out.max;
+    const bool allTs = tsLo == 0 && static_cast<int64_t>(tsHi) > tsMax_ - tsBase_;
+    if (allTs && measType < 0) {
+        for (uint64_t i = b; i < e; ++i) {
+            const double v = value_[i];
+            sum += v;
+            mn = v < mn ? v : mn;
+            mx = v > mx ? v : mx;
+        }
+        count = e - b;
+    } else {
+        const bool anyType = measType < 0;
+        const uint32_t type = anyType ? 0 : static_cast<uint32_t>(measType);
+        for (uint64_t i = b; i < e; ++i) {
+            const double v = value_[i];
+            const uint32_t d = tsDelta_[i];
+            const bool m = (d >= tsLo) & (d < tsHi) & (anyType | (measType_[i] == type));
+            count += m;
+            sum += m ? v : 0.0;
+            mn = m & (v < mn) ? v : mn;
+            mx = m & (v > mx) ? v : mx;
+        }
+    }
+    out.count += count;
+    out.sum += sum;
+    out.min = mn;
+    out.max = mx;
+}
+
+Aggregate SegmentReader::aggregate(const ScanFilter& f) const {
+    Aggregate out;
+    if (!base_ || rows_ == 0 || f.to <= tsMin_ || f.from > tsMax_) return out;
+
+    auto clampDelta = [this](int64_t t) -> uint32_t {
+        if (t <= tsBase_) return 0;
+        return static_cast<uint32_t>(std::min<int64_t>(t - tsBase_, UINT32_MAX));
+    };
+    const uint32_t tsLo = clampDelta(f.from);
+    const uint32_t tsHi = clampDelta(f.to);
+
+    // Sorted dictionaries turn the MO prefix into an id range.
+    uint32_t moLo = 0, moHi = mos_.count;
+    if (!f.moPrefix.empty()) {
+        moLo = mos_.lowerBound(f.moPrefix);
+        moHi = moLo;
+        uint32_t hi = mos_.count;
+        while (moHi < hi) {
+            uint32_t mid = moHi + (hi - moHi) / 2;
+            if (mos_.name(mid).substr(0, f.moPrefix.size()) == f.moPrefix) moHi = mid + 1;
+            else hi = mid;
+        }
+        if (moLo == moHi) return out;
+    }
+
+    int64_t measType = -1;
+    if (!f.measType.empty()) {
+        uint32_t id = measTypes_.lowerBound(f.measType);
+        if (id == measTypes_.count || measTypes_.name(id) != f.measType) return out;
+        measType = id;
+    }
+
+    uint32_t cLo = 0, cHi = counters_.count;
+    if (!f.counter.empty()) {
+        cLo = counters_.lowerBound(f.counter);
+        if (cLo == counters_.count || counters_.name(cLo) != f.counter) return out;
+        cHi = cLo + 1;
+    }
+
+    for (uint32_t c = cLo; c < cHi; ++c) {
+        scanRange(counterStart_[c], counterStart_[c + 1], moLo, moHi, measType, tsLo, tsHi, out);
+    }
+    return out;
+}
+
+Aggregate scanSegments(const std::string& dir, const ScanFilter& f, size_t* segmentsScanned) {
+    std::vector<std::string> paths;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".seg") paths.push_back(entry.path().string());
+    }
+    if (ec) std::cerr << "Ошибка сегментов: " << dir << ": " << ec.message() << "\n";
+    // Fixed order keeps floating-point sums reproducible.
+    std::sort(paths.begin(), paths.end());
+
+    Aggregate total;
+    size_t scanned = 0;
+    SegmentReader reader;
+    for (const auto& p : paths) {
+        if (!reader.open(p)) continue;
+        if (f.to > reader.tsMin() && f.from <= reader.tsMax()) {
+            total.merge(reader.aggregate(f));
+            ++scanned;
+        }
+    }
+    if (segmentsScanned) *segmentsScanned = scanned;
+    return total;
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct RecordBatch;
+
+// Columnar segment files (*.seg) for analytical scans, written next to the
+// SQLite output. One segment holds the rows of one time window (by default
+// one 15-minute ROP):
+//
+//   header   magic "ENIQSEG1", version, byte-order mark, row count, footer offset
+//   columns  value f64[n] | ts_delta u32[n] | mo u32[n] | meas_type u32[n]
+//   dicts    MO, measurement type and counter names, each sorted
+//   index    first row of every counter id (counters + 1 entries)
+//   footer   time range, column/dict/index offsets
+//
+// Rows are sorted by (counter, mo, ts), so one counter is one contiguous
+// slice of the value column (its id is implied by the index) and an MO
+// prefix is a sub-slice of that.
+// Timestamps are stored as seconds from the window start. Files use host
+// byte order and are rejected on a machine with the other one.
+
+struct SegmentOptions {
+    int64_t windowSeconds = 900;
+    size_t maxBufferedRows = 4 * 1000 * 1000; // flush everything beyond this
+    bool quiet = false;                       // no "Сегмент ..." line per segment
+};
+
+class SegmentWriter {
+public:
+    explicit SegmentWriter(std::string dir, SegmentOptions opts = {});
+
+    // Buffers the records of `batch` per window. Expects a deduplicated
+    // batch, as DbWriter::write() leaves it; rows with an unparsable
+    // timestamp are dropped (DbWriter reports them).
+    bool write(const RecordBatch& batch);
+
+    // Writes one new segment per buffered window and clears the buffer, also
+    // when a write fails. Segments are written under a temporary name and
+    // renamed into place.
+    bool flush();
+
+private:
+    struct Row {
+        uint32_t counter, mo, measType, tsDelta;
+        double value;
+    };
+
+    struct Dict {
+        std::unordered_map<std::string, uint32_t> ids;
+        std::vector<std::string> names;
+        uint32_t id(std::string_view name);
+    };
+
+    struct Window {
+        Dict mos, measTypes, counters;
+        std::vector<Row> rows;
+    };
+
+    bool writeWindow(int64_t start, Window& w);
+
+    std::string dir_;
+    SegmentOptions opts_;
+    std::map<int64_t, Window> windows_;
+    size_t buffered_ = 0;
+    std::vector<int64_t> tsMap_;
+    std::vector<uint32_t> moMap_, measTypeMap_, counterMap_;
+};
+
+struct ScanFilter {
+    int64_t from = std::numeric_limits<int64_t>::min(); // inclusive, epoch seconds
+    int64_t to = std::numeric_limits<int64_t>::max();   // exclusive
+    std::string moPrefix;
+    std::string measType; // empty = any
+    std::string counter;  // empty = any
+};
+
+struct Aggregate {
+    uint64_t count = 0;
+    double sum = 0.0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+
+    double avg() const { return count ? sum / count : 0.0; }
+    void merge(const Aggregate& o);
+};
+
+// Read-only view of one memory-mapped segment.
+class SegmentReader {
+public:
+    SegmentReader() = default;
+    ~SegmentReader();
+
+    SegmentReader(const SegmentReader&) = delete;
+    SegmentReader& operator=(const SegmentReader&) = delete;
+
+    // Maps `path` and validates its layout; prints the reason on failure.
+    bool open(const std::string& path);
+    void close();
+
+    uint64_t rows() const { return rows_; }
+    int64_t tsMin() const { return tsMin_; }
+    int64_t tsMax() const { return tsMax_; }
+
+    Aggregate aggregate(const ScanFilter& f) const;
+
+private:
+    struct DictView {
+        uint32_t count = 0;
+        const uint32_t* offsets = nullptr; // count + 1 entries into chars
+        const char* chars = nullptr;
+        std::string_view name(uint32_t id) const {
+            return std::string_view(chars + offsets[id], offsets[id + 1] - offsets[id]);
+        }
+        // First id whose name is not less than `s` (names are sorted).
+        uint32_t lowerBound(std::string_view s) const;
+    };
+
+    void scanRange(uint64_t b, uint64_t e, uint32_t moLo, uint32_t moHi, int64_t measType, uint32_t tsLo,
+                   uint32_t tsHi, Aggregate& out) const;
+
+    const char* base_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+
+    uint64_t rows_ = 0;
+    int64_t tsBase_ = 0, tsMin_ = 0, tsMax_ = 0;
+    const double* value_ = nullptr;
+    const uint32_t* tsDelta_ = nullptr;
+    const uint32_t* mo_ = nullptr;
+    const uint32_t* measType_ = nullptr;
+    const uint64_t* counterStart_ = nullptr; // counters.count + 1 row offsets
+    DictView mos_, measTypes_, counters_;
+};
+
+// Aggregates over every *.seg file in `dir`, skipping segments outside the
+// filter's time range without touching their columns.
+Aggregate scanSegments(const std::string& dir, const ScanFilter& f, size_t* segmentsScanned = nullptr);
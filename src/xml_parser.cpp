@@ -1,54 +1,310 @@
 #include "xml_parser.h"
-#include <pugixml.hpp>
-#include <sstream>
+#include "xml_stream.h"
+#include "record_batch.h"
+#include "metrics.h"
+#include <charconv>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <string_view>
 
-bool parse_ericsson_pm_xml(const std::string& xmlPath, std::vector<CounterRecord>& records) {
-    pugi::xml_document doc;
-    pugi::xml_parse_result result = doc.load_file(xmlPath.c_str(), pugi::parse_default | pugi::parse_trim_pcdata);
+namespace {
+
+// Elements the PM walk cares about. Anything else (and these names in an
+// unexpected position) is `Other` and only tracked for nesting.
+enum class Tag : unsigned char { Other, MeasCollec, MeasInfo, MeasTypes, MeasValue, MeasObjLdn, R };
+
+bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && isSpace(s.front())) s.remove_prefix(1);
+    while (!s.empty() && isSpace(s.back())) s.remove_suffix(1);
+    return s;
+}
+
+// What strtod (and so pugixml's as_double(0.0)) gives for the values PM
+// files carry, without depending on the C locale: a leading number with an
+// optional sign, 0x hex, inf/nan, +-inf on overflow and 0 on underflow;
+// 0.0 when there is no number at all.
+double parseValue(std::string_view s) {
+    s = trim(s);
+    if (!s.empty() && s.front() == '+') s.remove_prefix(1);
+    const bool negative = !s.empty() && s.front() == '-';
+    if (negative) s.remove_prefix(1);
+    auto format = std::chars_format::general;
+    char exponent = 'e';
+    if (s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s.remove_prefix(2);
+        format = std::chars_format::hex;
+        exponent = 'p';
+    }
+    double v = 0.0;
+    auto res = std::from_chars(s.data(), s.data() + s.size(), v, format);
+    if (res.ec == std::errc::result_out_of_range) {
+        const size_t e = s.find_first_of(exponent == 'e' ? "eE" : "pP");
+        const bool underflow = e != std::string_view::npos && e + 1 < s.size() && s[e + 1] == '-';
+        v = underflow ? 0.0 : std::numeric_limits<double>::infinity();
+    } else if (res.ec != std::errc()) {
+        return 0.0;
+    }
+    return negative ? -v : v;
+}
+
+// Times the reads of `inner` for ParseInfo::readSeconds. One clock pair per
+// chunk of the XML reader, so the cost does not show.
+class TimedSource : public ByteSource {
+public:
+    TimedSource(ByteSource& inner, double& seconds) : inner_(inner), seconds_(seconds) {}
+
+    size_t read(char* buf, size_t size) override {
+        StageTimer t(&seconds_);
+        size_t n = inner_.read(buf, size);
+        if (inner_.failed()) error_ = inner_.error();
+        return n;
+    }
+
+private:
+    ByteSource& inner_;
+    double& seconds_;
+};
 
-    if (!result) {
-        std::cerr << "Ошибка XML: " << result.description() << " в файле " << xmlPath << "\n";
+template <class Fn>
+void forEachToken(std::string_view s, Fn&& fn) {
+    size_t i = 0;
+    while (i < s.size()) {
+        while (i < s.size() && isSpace(s[i])) ++i;
+        size_t b = i;
+        while (i < s.size() && !isSpace(s[i])) ++i;
+        if (i > b) fn(s.substr(b, i - b));
+    }
+}
+
+// Single forward pass over the PM structure. `Handler` gets
+//   measInfo()                              at each <measInfo>
+//   measTypes(text)                         with the raw measTypes text
+//   measValue(ts, measInfoId, mo, values)   once a <measValue> is closed
+// so the record representation is up to the handler.
+template <class Handler>
+bool walkPmFile(const std::string& xmlPath, Handler& handler, ParseInfo* info = nullptr) {
+    FileSource src(xmlPath);
+    if (!src.isOpen()) {
+        std::cerr << "Ошибка XML: " << src.error() << " в файле " << xmlPath << "\n";
         return false;
     }
+    ByteSource* input = &src;
+#ifdef ENIQ_HAVE_ZLIB
+    std::unique_ptr<GzipSource> gz;
+    if (isGzipPath(xmlPath)) {
+        gz = std::make_unique<GzipSource>(src);
+        input = gz.get();
+    }
+#else
+    if (isGzipPath(xmlPath)) {
+        std::cerr << "Ошибка XML: собрано без zlib, .gz не поддерживается в файле " << xmlPath << "\n";
+        return false;
+    }
+#endif
+    // With `info` the reads and the handler calls are timed as well. A
+    // clock pair costs about as much as a small measValue, so only every
+    // kBuildSample-th measValue is timed and the sum is scaled up at the end.
+    constexpr size_t kBuildSample = 8;
+    std::unique_ptr<TimedSource> timed;
+    double* buildSeconds = nullptr;
+    double sampledBuild = 0.0;
+    size_t measValues = 0, sampled = 0;
+    if (info) {
+        timed = std::make_unique<TimedSource>(*input, info->readSeconds);
+        input = timed.get();
+        buildSeconds = &info->buildSeconds;
+    }
+    XmlStreamReader xml(*input);
+
+    std::vector<Tag> tags;
+    std::string text;
 
     std::string ts;
-    pugi::xpath_node colNode = doc.select_node("//measCollec");
-    if (colNode) {
-        pugi::xml_node mc = colNode.node();
-        if (mc) {
-            pugi::xml_attribute a = mc.attribute("beginTime");
-            if (a) ts = a.as_string();
+    bool seenCollec = false;
+
+    std::string measId;
+    bool seenTypes = false;
+
+    std::string mo;
+    bool seenMo = false;
+    std::vector<double> values;
+
+    for (;;) {
+        switch (xml.next()) {
+        case XmlStreamReader::Event::StartElement: {
+            std::string_view n = xml.name();
+            Tag parent = tags.empty() ? Tag::Other : tags.back();
+            Tag t = Tag::Other;
+
+            if (n == "measCollec") {
+                t = Tag::MeasCollec;
+                if (!seenCollec) {
+                    seenCollec = true;
+                    xml.attribute("beginTime", ts);
+                }
+            } else if (n == "measInfo") {
+                t = Tag::MeasInfo;
+                if (!xml.attribute("measInfoId", measId)) measId.clear();
+                seenTypes = false;
+                handler.measInfo();
+            } else if (parent == Tag::MeasInfo && n == "measTypes" && !seenTypes) {
+                t = Tag::MeasTypes;
+                seenTypes = true;
+                text.clear();
+            } else if (parent == Tag::MeasInfo && n == "measValue") {
+                t = Tag::MeasValue;
+                mo.clear();
+                seenMo = false;
+                values.clear();
+            } else if (parent == Tag::MeasValue && n == "measObjLdn" && !seenMo) {
+                t = Tag::MeasObjLdn;
+                seenMo = true;
+                text.clear();
+            } else if (parent == Tag::MeasValue && n == "r") {
+                t = Tag::R;
+                text.clear();
+            }
+            tags.push_back(t);
+            break;
+        }
+
+        case XmlStreamReader::Event::Text: {
+            Tag t = tags.back();
+            if (t == Tag::MeasTypes || t == Tag::MeasObjLdn || t == Tag::R) text.append(xml.text());
+            break;
+        }
+
+        case XmlStreamReader::Event::EndElement: {
+            Tag t = tags.back();
+            tags.pop_back();
+
+            if (t == Tag::MeasTypes) {
+                StageTimer build(buildSeconds);
+                handler.measTypes(text);
+            } else if (t == Tag::MeasObjLdn) {
+                std::string_view v = trim(text);
+                mo.assign(v.data(), v.size());
+            } else if (t == Tag::R) {
+                values.push_back(parseValue(text));
+            } else if (t == Tag::MeasValue) {
+                // measObjLdn may follow the r elements, so records for a
+                // measValue are only emitted once it is closed.
+                const bool sample = buildSeconds && measValues++ % kBuildSample == 0;
+                sampled += sample;
+                StageTimer build(sample ? &sampledBuild : nullptr);
+                handler.measValue(ts, measId, mo, values);
+            }
+            break;
+        }
+
+        case XmlStreamReader::Event::EndDocument:
+            // The reader only ends the document at end of input, so the
+            // whole file has gone through the hash by now (for .gz the
+            // compressed bytes, like hashFile()).
+            if (info) {
+                info->bytes = src.bytesRead();
+                info->contentHash = src.hash();
+                if (sampled) info->buildSeconds += sampledBuild * measValues / sampled;
+            }
+            return true;
+
+        case XmlStreamReader::Event::Error:
+            std::cerr << "Ошибка XML: " << xml.error() << " в файле " << xmlPath << "\n";
+            return false;
         }
     }
+}
+
+std::string unknownCounter(size_t idx) {
+    return "unk_" + std::to_string(idx);
+}
+
+class CallbackHandler {
+public:
+    explicit CallbackHandler(const RecordCallback& onRecord) : onRecord_(onRecord) {}
+
+    void measInfo() { counters_.clear(); }
 
-    for (pugi::xpath_node xn : doc.select_nodes("//measInfo")) {
-        pugi::xml_node measInfo = xn.node();
-        std::string measId = measInfo.attribute("measInfoId").as_string();
+    void measTypes(std::string_view text) {
+        counters_.clear();
+        forEachToken(text, [this](std::string_view tok) { counters_.emplace_back(tok); });
+    }
 
-        // Список имён счётчиков
-        std::vector<std::string> counters;
-        pugi::xml_node typesNode = measInfo.child("measTypes");
-        if (typesNode) {
-            std::istringstream iss(typesNode.text().as_string());
-            std::string token;
-            while (iss >> token) counters.push_back(token);
+    void measValue(const std::string& ts, const std::string& measId, const std::string& mo,
+                   const std::vector<double>& values) {
+        rec_.timestamp = ts;
+        rec_.mo_ldn = mo;
+        rec_.meas_type = measId;
+        for (size_t idx = 0; idx < values.size(); ++idx) {
+            if (idx < counters_.size()) rec_.counter_name = counters_[idx];
+            else rec_.counter_name = unknownCounter(idx);
+            rec_.value = values[idx];
+            onRecord_(rec_);
         }
+    }
 
-        for (pugi::xml_node val : measInfo.children("measValue")) {
-            std::string mo = val.child("measObjLdn").text().as_string();
+private:
+    const RecordCallback& onRecord_;
+    std::vector<std::string> counters_;
+    CounterRecord rec_;
+};
 
-            size_t idx = 0;
-            for (pugi::xml_node r : val.children("r")) {
-                double v = r.text().as_double(0.0);
-                std::string name = (idx < counters.size()) ? counters[idx] : ("unk_" + std::to_string(idx));
-                records.push_back({ts, mo, measId, name, v});
-                ++idx;
-            }
+// Interns every string once per distinct value: the timestamp, measInfoId
+// and DN per measValue and the counter names per measTypes.
+class BatchHandler {
+public:
+    explicit BatchHandler(RecordBatch& batch) : batch_(batch) {}
+
+    void measInfo() { counters_.clear(); }
+
+    void measTypes(std::string_view text) {
+        counters_.clear();
+        forEachToken(text, [this](std::string_view tok) { counters_.push_back(batch_.strings.intern(tok)); });
+    }
+
+    void measValue(const std::string& ts, const std::string& measId, const std::string& mo,
+                   const std::vector<double>& values) {
+        PmRecord r;
+        r.timestamp = batch_.strings.intern(ts);
+        r.mo = batch_.strings.intern(mo);
+        r.measType = batch_.strings.intern(measId);
+        for (size_t idx = 0; idx < values.size(); ++idx) {
+            r.counter = idx < counters_.size() ? counters_[idx] : batch_.strings.intern(unknownCounter(idx));
+            r.value = values[idx];
+            batch_.records.push_back(r);
         }
     }
 
-    return true;
+private:
+    RecordBatch& batch_;
+    std::vector<uint32_t> counters_;
+};
+
+} // namespace
+
+bool parse_ericsson_pm_xml_stream(const std::string& xmlPath, const RecordCallback& onRecord) {
+    CallbackHandler handler(onRecord);
+    return walkPmFile(xmlPath, handler);
+}
+
+bool parse_ericsson_pm_xml(const std::string& xmlPath, RecordBatch& batch, ParseInfo* info) {
+    const size_t before = batch.records.size();
+    BatchHandler handler(batch);
+    bool ok = walkPmFile(xmlPath, handler, info);
+    if (!ok) batch.records.resize(before);
+    return ok;
+}
+
+bool parse_ericsson_pm_xml(const std::string& xmlPath, std::vector<CounterRecord>& records) {
+    const size_t before = records.size();
+    bool ok = parse_ericsson_pm_xml_stream(xmlPath, [&records](const CounterRecord& r) {
+        records.push_back(r);
+    });
+    if (!ok) records.resize(before);
+    return ok;
 }
-// Only `parseEricssonPM` is provided; duplicate alternative implementations
-// were removed to avoid redundancy and conflicting declarations.
@@ -1,7 +1,11 @@
 #pragma once
+#include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 
+struct RecordBatch;
+
 struct CounterRecord {
     std::string timestamp;
     std::string mo_ldn;
@@ -10,6 +14,31 @@ struct CounterRecord {
     double value = 0.0;
 };
 
+// Called once per `r` value. The record is reused between calls, so copy
+// whatever has to outlive the callback.
+using RecordCallback = std::function<void(const CounterRecord&)>;
+
+// Stream Ericsson PM XML at `xmlPath` in a single forward pass, handing each
+// record to `onRecord` as soon as its measValue is complete. Memory use does
+// not depend on the file size. Returns true on success; records emitted
+// before a parse error are not retracted.
+bool parse_ericsson_pm_xml_stream(const std::string& xmlPath, const RecordCallback& onRecord);
+
+// What was read from the file, for the ingest manifest and metrics.
+struct ParseInfo {
+    uint64_t bytes = 0;
+    uint64_t contentHash = 0; // FNV-1a of the file bytes
+    // Parts of the call spent reading input (disk, gzip inflate) and
+    // turning measValues into records; the rest is XML parsing.
+    double readSeconds = 0.0;
+    double buildSeconds = 0.0;
+};
+
+// Parse Ericsson PM XML at `xmlPath` into `batch`, interning the strings so
+// that each record costs no heap allocation. Returns true on success; on
+// failure no records are added (strings interned so far are kept).
+bool parse_ericsson_pm_xml(const std::string& xmlPath, RecordBatch& batch, ParseInfo* info = nullptr);
+
 // Parse Ericsson PM XML at `xmlPath` and append found records to `records`.
-// Returns true on success.
+// Returns true on success; on failure `records` is left unchanged.
 bool parse_ericsson_pm_xml(const std::string& xmlPath, std::vector<CounterRecord>& records);
@@ -0,0 +1,300 @@
+#include "xml_stream.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr size_t kChunkSize = 64 * 1024;
+
+bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool isNameEnd(char c) {
+    return isSpace(c) || c == '/' || c == '>' || c == '=';
+}
+
+void appendUtf8(std::string& out, unsigned long cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+// Replaces predefined and numeric character references. Unknown references
+// are copied through unchanged, as pugixml does.
+void decodeEntities(std::string_view raw, std::string& out) {
+    out.clear();
+    size_t i = 0;
+    while (i < raw.size()) {
+        size_t amp = raw.find('&', i);
+        if (amp == std::string_view::npos) {
+            out.append(raw.data() + i, raw.size() - i);
+            break;
+        }
+        out.append(raw.data() + i, amp - i);
+        size_t semi = raw.find(';', amp);
+        if (semi == std::string_view::npos) {
+            out.append(raw.data() + amp, raw.size() - amp);
+            break;
+        }
+        std::string_view ent = raw.substr(amp + 1, semi - amp - 1);
+        if (ent == "lt") out += '<';
+        else if (ent == "gt") out += '>';
+        else if (ent == "amp") out += '&';
+        else if (ent == "quot") out += '"';
+        else if (ent == "apos") out += '\'';
+        else if (ent.size() > 1 && ent[0] == '#') {
+            unsigned long cp = 0;
+            bool hex = ent[1] == 'x';
+            bool ok = ent.size() > (hex ? 2u : 1u);
+            for (size_t k = hex ? 2 : 1; k < ent.size() && ok; ++k) {
+                char c = ent[k];
+                unsigned d;
+                if (c >= '0' && c <= '9') d = c - '0';
+                else if (hex && c >= 'a' && c <= 'f') d = c - 'a' + 10;
+                else if (hex && c >= 'A' && c <= 'F') d = c - 'A' + 10;
+                else { ok = false; break; }
+                cp = cp * (hex ? 16 : 10) + d;
+                if (cp > 0x10FFFF) ok = false;
+            }
+            if (ok) appendUtf8(out, cp);
+            else out.append(raw.data() + amp, semi - amp + 1);
+        } else {
+            out.append(raw.data() + amp, semi - amp + 1);
+        }
+        i = semi + 1;
+    }
+}
+
+} // namespace
+
+XmlStreamReader::XmlStreamReader(ByteSource& src) : src_(src) {
+    buf_.reserve(2 * kChunkSize);
+    if (fill() && buf_.compare(0, 3, "\xEF\xBB\xBF") == 0) pos_ = 3;
+}
+
+bool XmlStreamReader::fill() {
+    if (eof_) return false;
+    size_t old = buf_.size();
+    buf_.resize(old + kChunkSize);
+    size_t n = src_.read(&buf_[old], kChunkSize);
+    buf_.resize(old + n);
+    if (n == 0) eof_ = true;
+    return n > 0;
+}
+
+size_t XmlStreamReader::find(size_t from, char c) {
+    for (;;) {
+        size_t p = buf_.find(c, from);
+        if (p != std::string::npos) return p;
+        from = buf_.size();
+        if (!fill()) return std::string::npos;
+    }
+}
+
+size_t XmlStreamReader::find(size_t from, std::string_view seq) {
+    for (;;) {
+        size_t p = buf_.find(seq.data(), from, seq.size());
+        if (p != std::string::npos) return p;
+        if (buf_.size() >= seq.size()) from = std::max(from, buf_.size() - seq.size() + 1);
+        if (!fill()) return std::string::npos;
+    }
+}
+
+XmlStreamReader::Event XmlStreamReader::fail(const char* what) {
+    error_ = src_.failed() ? src_.error() : what;
+    return Event::Error;
+}
+
+bool XmlStreamReader::attribute(std::string_view attrName, std::string& out) const {
+    for (const Attr& a : attrs_) {
+        if (std::string_view(buf_.data() + a.nameOff, a.nameLen) != attrName) continue;
+        std::string_view raw(buf_.data() + a.valueOff, a.valueLen);
+        if (raw.find('&') == std::string_view::npos) out.assign(raw.data(), raw.size());
+        else decodeEntities(raw, out);
+        return true;
+    }
+    return false;
+}
+
+XmlStreamReader::Event XmlStreamReader::next() {
+    if (pendingEnd_) {
+        pendingEnd_ = false;
+        name_ = stack_[--depth_];
+        return Event::EndElement;
+    }
+
+    // Drop consumed input once it is worth the move; views handed out by the
+    // previous call are no longer valid at this point.
+    if (pos_ >= kChunkSize) {
+        buf_.erase(0, pos_);
+        pos_ = 0;
+    }
+
+    for (;;) {
+        if (pos_ >= buf_.size() && !fill()) {
+            if (src_.failed()) return fail("");
+            if (depth_ > 0) return fail("Unexpected end of file");
+            if (!sawRoot_) return fail("No document element found");
+            return Event::EndDocument;
+        }
+
+        if (buf_[pos_] != '<') {
+            size_t lt = find(pos_, '<');
+            size_t end = lt == std::string::npos ? buf_.size() : lt;
+            std::string_view raw(buf_.data() + pos_, end - pos_);
+            pos_ = end;
+            if (depth_ == 0) continue; // whitespace around the root element
+            if (raw.find('&') == std::string_view::npos) {
+                text_ = raw;
+            } else {
+                decodeEntities(raw, scratch_);
+                text_ = scratch_;
+            }
+            return Event::Text;
+        }
+
+        if (pos_ + 1 >= buf_.size() && !fill()) return fail("Unexpected end of file");
+        char c = buf_[pos_ + 1];
+
+        if (c == '/') return readEndTag();
+
+        if (c == '?') {
+            size_t e = find(pos_ + 2, "?>");
+            if (e == std::string::npos) return fail("Error parsing document declaration/processing instruction");
+            pos_ = e + 2;
+            continue;
+        }
+
+        if (c == '!') {
+            while (buf_.size() - pos_ < 9 && fill()) {}
+            if (buf_.compare(pos_, 4, "<!--") == 0) {
+                size_t e = find(pos_ + 4, "-->");
+                if (e == std::string::npos) return fail("Error parsing comment");
+                pos_ = e + 3;
+                continue;
+            }
+            if (buf_.compare(pos_, 9, "<![CDATA[") == 0) {
+                size_t e = find(pos_ + 9, "]]>");
+                if (e == std::string::npos) return fail("Error parsing CDATA section");
+                text_ = std::string_view(buf_.data() + pos_ + 9, e - pos_ - 9);
+                pos_ = e + 3;
+                if (depth_ == 0) return fail("Error parsing CDATA section");
+                return Event::Text;
+            }
+            if (buf_.compare(pos_, 9, "<!DOCTYPE") == 0) {
+                if (!skipDoctype()) return fail("Error parsing document type declaration");
+                continue;
+            }
+            return fail("Unrecognized tag");
+        }
+
+        return readStartTag();
+    }
+}
+
+XmlStreamReader::Event XmlStreamReader::readStartTag() {
+    size_t i = pos_ + 1;
+    auto at = [&](size_t k) -> int {
+        while (k >= buf_.size()) {
+            if (!fill()) return -1;
+        }
+        return static_cast<unsigned char>(buf_[k]);
+    };
+
+    size_t nameOff = i;
+    for (int c; (c = at(i)) >= 0 && !isNameEnd(static_cast<char>(c));) ++i;
+    if (at(i) < 0) return fail("Unexpected end of file");
+    size_t nameLen = i - nameOff;
+    if (nameLen == 0) return fail("Error parsing start element tag");
+
+    attrs_.clear();
+    bool selfClosing = false;
+    for (;;) {
+        int c;
+        while ((c = at(i)) >= 0 && isSpace(static_cast<char>(c))) ++i;
+        if (c < 0) return fail("Unexpected end of file");
+        if (c == '>') { ++i; break; }
+        if (c == '/') {
+            if (at(i + 1) != '>') return fail("Error parsing start element tag");
+            selfClosing = true;
+            i += 2;
+            break;
+        }
+
+        Attr a{};
+        a.nameOff = i;
+        while ((c = at(i)) >= 0 && !isNameEnd(static_cast<char>(c))) ++i;
+        a.nameLen = i - a.nameOff;
+        while ((c = at(i)) >= 0 && isSpace(static_cast<char>(c))) ++i;
+        if (a.nameLen == 0 || c != '=') return fail("Error parsing attribute");
+        ++i;
+        while ((c = at(i)) >= 0 && isSpace(static_cast<char>(c))) ++i;
+        if (c != '"' && c != '\'') return fail("Error parsing attribute");
+        size_t q = find(i + 1, static_cast<char>(c));
+        if (q == std::string::npos) return fail("Unexpected end of file");
+        a.valueOff = i + 1;
+        a.valueLen = q - i - 1;
+        attrs_.push_back(a);
+        i = q + 1;
+    }
+
+    if (depth_ == 0 && sawRoot_) return fail("Multiple document elements");
+    sawRoot_ = true;
+
+    if (stack_.size() <= depth_) stack_.emplace_back();
+    stack_[depth_].assign(buf_.data() + nameOff, nameLen);
+    name_ = stack_[depth_];
+    ++depth_;
+    pos_ = i;
+
+    if (selfClosing) pendingEnd_ = true;
+    return Event::StartElement;
+}
+
+XmlStreamReader::Event XmlStreamReader::readEndTag() {
+    size_t gt = find(pos_ + 2, '>');
+    if (gt == std::string::npos) return fail("Unexpected end of file");
+    size_t b = pos_ + 2, e = gt;
+    while (e > b && isSpace(buf_[e - 1])) --e;
+    std::string_view n(buf_.data() + b, e - b);
+    if (depth_ == 0 || n != stack_[depth_ - 1]) return fail("Start-end tags mismatch");
+    name_ = stack_[--depth_];
+    pos_ = gt + 1;
+    return Event::EndElement;
+}
+
+bool XmlStreamReader::skipDoctype() {
+    size_t i = pos_ + 9;
+    int bracket = 0;
+    char quote = 0;
+    for (;;) {
+        if (i >= buf_.size() && !fill()) return false;
+        char c = buf_[i];
+        if (quote) {
+            if (c == quote) quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '[') {
+            ++bracket;
+        } else if (c == ']') {
+            --bracket;
+        } else if (c == '>' && bracket <= 0) {
+            pos_ = i + 1;
+            return true;
+        }
+        ++i;
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "input_source.h"
+
+// Forward-only pull reader for XML. Only the token being read is kept in
+// memory, so memory use does not grow with the size of the document.
+// Covers what PM files contain: elements, attributes, character data,
+// CDATA, comments and processing instructions; DOCTYPE is skipped.
+class XmlStreamReader {
+public:
+    enum class Event { StartElement, EndElement, Text, EndDocument, Error };
+
+    explicit XmlStreamReader(ByteSource& src);
+
+    Event next();
+
+    // Views returned below stay valid until the next call to next().
+    std::string_view name() const { return name_; }
+    std::string_view text() const { return text_; }
+
+    // Copies the decoded value of attribute `attrName` of the current start
+    // element into `out`. Returns false if the attribute is absent.
+    bool attribute(std::string_view attrName, std::string& out) const;
+
+    // pugixml-style description of the failure after Event::Error.
+    const std::string& error() const { return error_; }
+
+private:
+    struct Attr {
+        size_t nameOff, nameLen;
+        size_t valueOff, valueLen;
+    };
+
+    bool fill();
+    size_t find(size_t from, char c);
+    size_t find(size_t from, std::string_view seq);
+    Event fail(const char* what);
+
+    Event readStartTag();
+    Event readEndTag();
+    bool skipDoctype();
+
+    ByteSource& src_;
+    std::string buf_;
+    size_t pos_ = 0;
+    bool eof_ = false;
+
+    std::vector<std::string> stack_;
+    size_t depth_ = 0;
+    bool pendingEnd_ = false;
+    bool sawRoot_ = false;
+
+    std::vector<Attr> attrs_;
+    std::string_view name_;
+    std::string_view text_;
+    std::string scratch_;
+    std::string error_;
+};
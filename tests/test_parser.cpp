@@ -1,7 +1,90 @@
 #include "../src/xml_parser.h"
+#include "../src/pm_time.h"
+#include "../src/db_writer.h"
+#include "../src/record_batch.h"
+#include "../src/segment_store.h"
+#include "../src/metrics.h"
+#include "../src/ingest.h"
+#include "../bench/pm_generator.h"
+#include <sqlite3.h>
+#ifdef ENIQ_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <vector>
 
+namespace fs = std::filesystem;
+
+// Tokenizer corner cases the streaming reader has to get right: prolog,
+// comments, CDATA, entities, self-closing tags and measObjLdn after the values.
+static const char* kTrickyXml =
+    "\xEF\xBB\xBF<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<!DOCTYPE measCollecFile [ <!ENTITY x \"y\"> ]>\n"
+    "<measCollecFile>\n"
+    "  <fileHeader><measCollec beginTime='2026-02-10T00:15:00+01:00'/></fileHeader>\n"
+    "  <measData>\n"
+    "    <!-- <measInfo> inside a comment is ignored -->\n"
+    "    <measInfo measInfoId=\"a&amp;b\">\n"
+    "      <job jobId=\"1\"/>\n"
+    "      <measTypes>\n  pmA\tpmB  pmC\n</measTypes>\n"
+    "      <measValue>\n"
+    "        <r> 10 </r><r><![CDATA[2.5e1]]></r><r/>\n"
+    "        <measObjLdn>SubNetwork=1,MeContext=&#x41;&#66;</measObjLdn>\n"
+    "      </measValue>\n"
+    "    </measInfo>\n"
+    "  </measData>\n"
+    "</measCollecFile>\n";
+
+// First column of the first row of `sql` run on the database at `db`; -1 on error.
+static int64_t queryInt(const fs::path& db, const char* sql) {
+    int64_t v = -1;
+    sqlite3* conn = nullptr;
+    if (sqlite3_open(db.string().c_str(), &conn) == SQLITE_OK) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+            v = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(conn);
+    return v;
+}
+
+static void removeDb(const fs::path& db) {
+    fs::remove(db);
+    fs::remove(db.string() + "-wal");
+    fs::remove(db.string() + "-shm");
+}
+
+// Every pm_counters row in id order, one line each; empty on error.
+static std::string dumpCounters(const fs::path& db) {
+    std::string out;
+    sqlite3* conn = nullptr;
+    if (sqlite3_open(db.string().c_str(), &conn) == SQLITE_OK) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(conn,
+                               "SELECT id, timestamp, mo_ldn, meas_type, counter_name, value"
+                               " FROM pm_counters ORDER BY id;",
+                               -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                for (int c = 0; c < 6; ++c) {
+                    const unsigned char* v = sqlite3_column_text(stmt, c);
+                    out += v ? reinterpret_cast<const char*>(v) : "NULL";
+                    out += c < 5 ? '\t' : '\n';
+                }
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(conn);
+    return out;
+}
+
 int main() {
     std::vector<CounterRecord> recs;
     bool ok = parse_ericsson_pm_xml("data/test.xml", recs);
@@ -13,6 +96,554 @@ int main() {
         std::cerr << "unexpected record count: " << recs.size() << "\n";
         return 3;
     }
+    if (recs[1].timestamp != "2026-02-10T00:00:00Z" || recs[1].mo_ldn != "MO1" ||
+        recs[1].meas_type != "m1" || recs[1].counter_name != "cnt2" || recs[1].value != 2.0) {
+        std::cerr << "unexpected record content\n";
+        return 4;
+    }
+
+    fs::path tricky = fs::temp_directory_path() / "eniq_test_tricky.xml";
+    {
+        std::ofstream out(tricky, std::ios::binary);
+        out << kTrickyXml;
+    }
+    std::vector<CounterRecord> streamed;
+    ok = parse_ericsson_pm_xml_stream(tricky.string(), [&streamed](const CounterRecord& r) {
+        streamed.push_back(r);
+    });
+    fs::remove(tricky);
+    if (!ok || streamed.size() != 3) {
+        std::cerr << "stream parse failed, records: " << streamed.size() << "\n";
+        return 5;
+    }
+    if (streamed[0].timestamp != "2026-02-10T00:15:00+01:00" || streamed[0].meas_type != "a&b" ||
+        streamed[0].mo_ldn != "SubNetwork=1,MeContext=AB" || streamed[0].counter_name != "pmA" ||
+        streamed[0].value != 10.0 || streamed[1].value != 25.0 || streamed[2].counter_name != "pmC" ||
+        streamed[2].value != 0.0) {
+        std::cerr << "unexpected streamed record content\n";
+        return 6;
+    }
+
+    // Values are read as strtod would: overflow, hex, underflow, junk, prefix.
+    fs::path values = fs::temp_directory_path() / "eniq_test_values.xml";
+    {
+        std::ofstream out(values, std::ios::binary);
+        out << "<measCollecFile><fileHeader><measCollec beginTime=\"2026-02-10T00:00:00Z\"/></fileHeader>"
+               "<measData><measInfo measInfoId=\"v\"><measTypes>a b c d e f</measTypes><measValue>"
+               "<measObjLdn>MO</measObjLdn><r>1e400</r><r>-1e400</r><r>0x10</r><r>1e-400</r><r>abc</r><r>12abc</r>"
+               "</measValue></measInfo></measData></measCollecFile>";
+    }
+    std::vector<CounterRecord> parsed;
+    ok = parse_ericsson_pm_xml(values.string(), parsed);
+    fs::remove(values);
+    const double inf = std::numeric_limits<double>::infinity();
+    if (!ok || parsed.size() != 6 || parsed[0].value != inf || parsed[1].value != -inf || parsed[2].value != 16.0 ||
+        parsed[3].value != 0.0 || parsed[4].value != 0.0 || parsed[5].value != 12.0) {
+        std::cerr << "value parsing differs from strtod\n";
+        return 18;
+    }
+
+    std::vector<CounterRecord> none;
+    if (parse_ericsson_pm_xml("data/does_not_exist.xml", none) || !none.empty()) {
+        std::cerr << "missing file must fail\n";
+        return 7;
+    }
+
+    // Same file twice: strings are interned once and dedupe drops the repeats.
+    RecordBatch batch;
+    if (!parse_ericsson_pm_xml("data/test.xml", batch) || !parse_ericsson_pm_xml("data/test.xml", batch) ||
+        batch.records.size() != 4 || batch.strings.size() != 5 || batch.dedupe() != 2 ||
+        batch.strings.view(batch.records[1].counter) != "cnt2" || batch.records[1].value != 2.0) {
+        std::cerr << "record batch parse/dedupe failed\n";
+        return 9;
+    }
+
+    // The deduplicated batch as one segment, read back through mmap.
+    fs::path segDir = fs::temp_directory_path() / "eniq_test_segments";
+    fs::remove_all(segDir);
+    SegmentWriter segments(segDir.string());
+    ScanFilter filter;
+    filter.counter = "cnt2";
+    filter.moPrefix = "MO";
+    size_t scanned = 0;
+    ok = segments.write(batch) && segments.flush();
+    Aggregate agg = scanSegments(segDir.string(), filter, &scanned);
+    filter.to = 1770681600; // 2026-02-10T00:00:00Z, exclusive
+    Aggregate before = scanSegments(segDir.string(), filter);
+    fs::remove_all(segDir);
+    if (!ok || scanned != 1 || agg.count != 1 || agg.sum != 2.0 || agg.min != 2.0 || agg.max != 2.0 ||
+        before.count != 0) {
+        std::cerr << "segment round trip failed, rows: " << agg.count << "\n";
+        return 11;
+    }
+
+    // Rollups count each stored row once: repeating a file adds nothing, a
+    // new counter for an already stored ROP and MO is added.
+    fs::path dbPath = fs::temp_directory_path() / "eniq_test_rollup.db";
+    fs::remove(dbPath);
+    {
+        DbOptions rollupOpts;
+        rollupOpts.rollups = true;
+        DbWriter db(rollupOpts);
+        RecordBatch again;
+        std::vector<CounterRecord> extra = {recs[0], recs[1]};
+        extra[1].counter_name = "cnt3";
+        extra[1].value = 5.0;
+        ok = db.open(dbPath.string()) && db.write(recs) && parse_ericsson_pm_xml("data/test.xml", again) &&
+             db.write(again) && db.flush() && db.write(extra) && db.flush();
+    }
+    int64_t rollupRows = 0, rollupCount = 0;
+    double rollupSum = 0.0;
+    sqlite3* check = nullptr;
+    if (ok && sqlite3_open(dbPath.string().c_str(), &check) == SQLITE_OK) {
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(check, "SELECT count(*), sum(value_count), sum(value_sum) FROM pm_rollup_day;", -1, &stmt,
+                           nullptr);
+        if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+            rollupRows = sqlite3_column_int64(stmt, 0);
+            rollupCount = sqlite3_column_int64(stmt, 1);
+            rollupSum = sqlite3_column_double(stmt, 2);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(check);
+    fs::remove(dbPath);
+    fs::remove(dbPath.string() + "-wal");
+    fs::remove(dbPath.string() + "-shm");
+    if (!ok || rollupRows != 3 || rollupCount != 3 || rollupSum != recs[0].value + 2.0 + 5.0) {
+        std::cerr << "rollup maintenance failed, rows: " << rollupRows << " count: " << rollupCount << "\n";
+        return 12;
+    }
+
+    // Normalized: dictionary ids survive a reopen, the pm_counters view has
+    // the flat shape, and rows with an unparsable timestamp are skipped
+    // (flat stores them as text).
+    fs::path normPath = fs::temp_directory_path() / "eniq_test_normalized.db";
+    removeDb(normPath);
+    int64_t idsBefore = -1;
+    {
+        DbOptions normOpts;
+        normOpts.schema = DbSchema::Normalized;
+        normOpts.quiet = true;
+        DbWriter db(normOpts);
+        ok = db.open(normPath.string()) && db.write(recs) && db.flush();
+        db.close();
+        idsBefore = queryInt(normPath, "SELECT sum(id * length(name)) FROM pm_counter;");
+        std::vector<CounterRecord> more = {recs[0], recs[1]};
+        more[0].counter_name = "cnt3";
+        more[1].timestamp = "not a time";
+        more[1].counter_name = "cnt4";
+        ok = ok && db.open(normPath.string()) && db.write(more) && db.flush();
+    }
+    const int64_t viewColumns = queryInt(normPath,
+                                         "SELECT count(*) FROM pragma_table_info('pm_counters') WHERE name IN"
+                                         " ('timestamp', 'mo_ldn', 'meas_type', 'counter_name', 'value');");
+    const int64_t idsAfter = queryInt(normPath, "SELECT sum(id * length(name)) FROM pm_counter WHERE name < 'cnt3';");
+    const int64_t viewRows = queryInt(normPath,
+                                      "SELECT count(*) FROM pm_counters WHERE timestamp = '2026-02-10T00:00:00Z'"
+                                      " AND mo_ldn = 'MO1' AND meas_type = 'm1'"
+                                      " AND counter_name IN ('cnt1', 'cnt2', 'cnt3')"
+                                      " AND value = CASE counter_name WHEN 'cnt2' THEN 2.0 ELSE 1.0 END;");
+    const int64_t badRows = queryInt(normPath, "SELECT count(*) FROM pm_value WHERE counter_id IN"
+                                               " (SELECT id FROM pm_counter WHERE name = 'cnt4');");
+    removeDb(normPath);
+    if (!ok || idsBefore <= 0 || idsAfter != idsBefore || viewColumns != 5 || viewRows != 3 || badRows != 0) {
+        std::cerr << "normalized schema check failed, view rows: " << viewRows << " bad rows: " << badRows << "\n";
+        return 21;
+    }
+
+    // A COMMIT refused while a reader holds the file keeps the transaction:
+    // later writes go into it and the next flush commits everything.
+    fs::path busyPath = fs::temp_directory_path() / "eniq_test_busy.db";
+    removeDb(busyPath);
+    {
+        DbOptions busyOpts;
+        busyOpts.journalMode = "DELETE";
+        busyOpts.busyTimeoutMs = 50;
+        busyOpts.quiet = true;
+        DbWriter db(busyOpts);
+        std::vector<CounterRecord> later = {recs[1]};
+        later[0].counter_name = "cnt3";
+        ok = db.open(busyPath.string()) && db.write(recs);
+        sqlite3* reader = nullptr;
+        ok = ok && sqlite3_open(busyPath.string().c_str(), &reader) == SQLITE_OK &&
+             sqlite3_exec(reader, "BEGIN; SELECT count(*) FROM sqlite_master;", nullptr, nullptr, nullptr) == SQLITE_OK;
+        ok = ok && !db.flush();
+        sqlite3_exec(reader, "COMMIT;", nullptr, nullptr, nullptr);
+        sqlite3_close(reader);
+        ok = ok && db.write(later) && db.flush();
+    }
+    const int64_t busyRows = queryInt(busyPath, "SELECT count(*) FROM pm_counters;");
+    removeDb(busyPath);
+    if (!ok || busyRows != 3) {
+        std::cerr << "failed COMMIT not recovered, rows: " << busyRows << "\n";
+        return 20;
+    }
+
+    // Rollups for a database that already has facts are only built on
+    // request, reading flat timestamps the way the parser does (+HHMM too).
+    fs::path buildPath = fs::temp_directory_path() / "eniq_test_build.db";
+    removeDb(buildPath);
+    {
+        DbOptions plain;
+        plain.quiet = true;
+        DbWriter db(plain);
+        CounterRecord offset = recs[1];
+        offset.timestamp = "2026-02-10T00:30:00+0100";
+        offset.mo_ldn = "MO2";
+        ok = db.open(buildPath.string()) && db.write(recs) && db.write(std::vector<CounterRecord>{offset}) &&
+             db.flush();
+        db.close();
+        DbOptions wanted = plain;
+        wanted.rollups = true;
+        DbWriter refused(wanted);
+        ok = ok && !refused.open(buildPath.string());
+        ok = ok && db.open(buildPath.string()) && db.buildRollups() && db.write(std::vector<CounterRecord>{recs[0]}) &&
+             db.flush();
+    }
+    const int64_t builtCount = queryInt(buildPath, "SELECT sum(value_count) FROM pm_rollup_hour;");
+    const int64_t offsetHour = queryInt(buildPath, "SELECT bucket FROM pm_rollup_hour WHERE mo_ldn = 'MO2';");
+    removeDb(buildPath);
+    if (!ok || builtCount != 3 || offsetHour != 1770678000) { // 2026-02-09T23:00:00Z
+        std::cerr << "rollup build failed, count: " << builtCount << " hour: " << offsetHour << "\n";
+        return 17;
+    }
+
+    // A write that fails part-way leaves none of its rows (or rollups) in the
+    // transaction; earlier writes in it are kept.
+    fs::path failPath = fs::temp_directory_path() / "eniq_test_fail.db";
+    removeDb(failPath);
+    {
+        DbOptions failOpts;
+        failOpts.rollups = true;
+        failOpts.rowsPerInsert = 1;
+        failOpts.quiet = true;
+        DbWriter db(failOpts);
+        std::vector<CounterRecord> bad = {recs[0], recs[1]};
+        bad[0].timestamp = bad[1].timestamp = "2026-02-10T01:00:00Z";
+        bad[1].counter_name = "boom";
+        ok = db.open(failPath.string()) &&
+             db.write(std::vector<CounterRecord>{recs[0], recs[1]}) && db.flush();
+        db.close();
+        sqlite3* conn = nullptr;
+        ok = ok && sqlite3_open(failPath.string().c_str(), &conn) == SQLITE_OK &&
+             sqlite3_exec(conn,
+                          "CREATE TRIGGER boom BEFORE INSERT ON pm_counters WHEN NEW.counter_name = 'boom'"
+                          " BEGIN SELECT RAISE(ABORT, 'boom'); END;",
+                          nullptr, nullptr, nullptr) == SQLITE_OK;
+        sqlite3_close(conn);
+        ok = ok && db.open(failPath.string()) && db.write(recs) && !db.write(bad) && db.flush();
+    }
+    const int64_t keptRows = queryInt(failPath, "SELECT count(*) FROM pm_counters;");
+    const int64_t keptRollups = queryInt(failPath, "SELECT sum(value_count) FROM pm_rollup_hour;");
+    removeDb(failPath);
+    if (!ok || keptRows != 2 || keptRollups != 2) {
+        std::cerr << "failed write not rolled back, rows: " << keptRows << " rollups: " << keptRollups << "\n";
+        return 15;
+    }
+
+    // With insertedOnly a re-sent file leaves only its new rows in the batch,
+    // so segments fed from it add up to the tables.
+    for (DbSchema schema : {DbSchema::Flat, DbSchema::Normalized}) {
+        fs::path keptPath = fs::temp_directory_path() / "eniq_test_inserted.db";
+        fs::path keptSegs = fs::temp_directory_path() / "eniq_test_inserted_segs";
+        removeDb(keptPath);
+        fs::remove_all(keptSegs);
+        DbOptions keptOpts;
+        keptOpts.schema = schema;
+        keptOpts.insertedOnly = true;
+        keptOpts.quiet = true;
+        SegmentWriter keptWriter(keptSegs.string());
+        RecordBatch first, resent;
+        CounterRecord extra = recs[1];
+        extra.counter_name = "cnt3";
+        extra.value = 5.0;
+        size_t firstRows = 0, resentRows = 0;
+        {
+            DbWriter db(keptOpts);
+            ok = db.open(keptPath.string()) && parse_ericsson_pm_xml("data/test.xml", first) && db.write(first) &&
+                 parse_ericsson_pm_xml("data/test.xml", resent);
+            resent.add(extra);
+            ok = ok && db.write(resent) && db.flush() && keptWriter.write(first) && keptWriter.write(resent) &&
+                 keptWriter.flush();
+            firstRows = first.records.size();
+            resentRows = resent.records.size();
+        }
+        const int64_t tableRows = queryInt(keptPath, "SELECT count(*) FROM pm_counters;");
+        Aggregate segAgg = scanSegments(keptSegs.string(), ScanFilter());
+        removeDb(keptPath);
+        fs::remove_all(keptSegs);
+        if (!ok || firstRows != 2 || resentRows != 1 || tableRows != 3 || segAgg.count != 3 ||
+            segAgg.sum != recs[0].value + 2.0 + 5.0) {
+            std::cerr << "insertedOnly batch mismatch, rows: " << firstRows << "+" << resentRows
+                      << " segments: " << segAgg.count << "\n";
+            return 16;
+        }
+    }
+
+    // --jobs stores the same rows in the same order as the serial loop, and a
+    // file that fails in a parser thread fails the run without holding up the rest.
+    fs::path jobsDir = fs::temp_directory_path() / "eniq_test_jobs";
+    fs::remove_all(jobsDir);
+    PmGenOptions jobsGen;
+    jobsGen.files = 6;
+    jobsGen.nodes = 2;
+    jobsGen.measInfos = 2;
+    jobsGen.mos = 30;
+    jobsGen.counters = 8;
+    jobsGen.dupRatio = 0.2;
+    PmGenStats jobsStats;
+    std::vector<std::string> jobsFiles = generatePmFiles(jobsDir.string(), jobsGen, jobsStats);
+    const fs::path broken = jobsDir / "broken.xml";
+    {
+        std::ofstream out(broken, std::ios::binary);
+        out << "<measCollecFile><measData><measInfo>";
+    }
+    jobsFiles.insert(jobsFiles.begin() + 3, broken.string());
+    std::string dumps[2];
+    bool results[2] = {true, true};
+    for (int run = 0; run < 2; ++run) {
+        fs::path runDb = jobsDir / ("run" + std::to_string(run) + ".db");
+        DbOptions runOpts;
+        runOpts.quiet = true;
+        runOpts.commitBatch = 1000;
+        IngestOptions ingest;
+        ingest.quiet = true;
+        ingest.jobs = run ? 3 : 1;
+        ingest.queueFiles = run ? 2 : 0;
+        {
+            DbWriter db(runOpts);
+            results[run] = db.open(runDb.string()) && ingestFiles(jobsFiles, db, ingest);
+        }
+        dumps[run] = dumpCounters(runDb);
+    }
+    fs::remove_all(jobsDir);
+    const size_t jobsRows = static_cast<size_t>(std::count(dumps[0].begin(), dumps[0].end(), '\n'));
+    if (jobsFiles.size() != 7 || results[0] || results[1] || dumps[0] != dumps[1] ||
+        jobsRows != jobsGen.files * jobsGen.measInfos * jobsGen.mos * jobsGen.counters) {
+        std::cerr << "parallel ingest differs from serial, rows: " << jobsRows << "\n";
+        return 19;
+    }
+
+    // Manifest: unchanged files are skipped, a touched one only gets its new
+    // mtime (Unix seconds), changed content is parsed again, and both .xml
+    // and .xml.gz files are picked up.
+    fs::path manDir = fs::temp_directory_path() / "eniq_test_manifest";
+    fs::remove_all(manDir);
+    fs::create_directories(manDir);
+    std::string testXml;
+    {
+        std::ifstream in("data/test.xml", std::ios::binary);
+        testXml.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        std::ofstream(manDir / "a.xml", std::ios::binary) << testXml;
+        std::ofstream(manDir / "notes.txt", std::ios::binary) << "not a PM file";
+    }
+    size_t manFiles = 1;
+#ifdef ENIQ_HAVE_ZLIB
+    {
+        std::string other = testXml;
+        other.replace(other.find("MO1"), 3, "MO2");
+        gzFile gz = gzopen((manDir / "b.xml.gz").string().c_str(), "wb");
+        gzwrite(gz, other.data(), static_cast<unsigned>(other.size()));
+        gzclose(gz);
+        manFiles = 2;
+    }
+#endif
+    const fs::path manDb = manDir / "manifest.db";
+    auto ingestDir = [&](IngestCounters& totals) {
+        DbOptions manOpts;
+        manOpts.quiet = true;
+        IngestMetrics metrics;
+        IngestOptions ingest;
+        ingest.quiet = true;
+        ingest.metrics = &metrics;
+        DbWriter db(manOpts);
+        const bool done = db.open(manDb.string()) && ingestFiles(listPmFiles(manDir.string()), db, ingest);
+        totals = metrics.totals();
+        return done;
+    };
+    const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                            std::chrono::system_clock::now().time_since_epoch()).count();
+    IngestCounters first, again, touched, changed;
+    ok = isPmFile("x.xml") && isPmFile("x.xml.gz") && !isPmFile("x.txt") && !isPmFile("x.gz") &&
+         listPmFiles(manDir.string()).size() == manFiles && ingestDir(first);
+    const int64_t manRows = queryInt(manDb, "SELECT count(*) FROM pm_counters;");
+    const std::string skewSql = "SELECT max(abs(mtime - " + std::to_string(now) + ")) FROM ingest_manifest;";
+    const int64_t mtimeSkew = queryInt(manDb, skewSql.c_str());
+    ok = ok && ingestDir(again);
+    fs::last_write_time(manDir / "a.xml", fs::last_write_time(manDir / "a.xml") + std::chrono::hours(1));
+    ok = ok && ingestDir(touched);
+    const int64_t touchedMtime = queryInt(manDb, "SELECT max(mtime) FROM ingest_manifest WHERE path LIKE '%a.xml';");
+    const int64_t hashBefore = queryInt(manDb, "SELECT hash FROM ingest_manifest WHERE path LIKE '%a.xml';");
+    {
+        std::string edited = testXml;
+        edited.replace(edited.find("2.0"), 3, "3.0"); // same size, new content
+        std::ofstream(manDir / "a.xml", std::ios::binary | std::ios::trunc) << edited;
+    }
+    fs::last_write_time(manDir / "a.xml", fs::last_write_time(manDir / "a.xml") + std::chrono::hours(2));
+    ok = ok && ingestDir(changed);
+    const int64_t hashAfter = queryInt(manDb, "SELECT hash FROM ingest_manifest WHERE path LIKE '%a.xml';");
+    const int64_t rowsAfter = queryInt(manDb, "SELECT count(*) FROM pm_counters;");
+    fs::remove_all(manDir);
+    if (!ok || manRows != static_cast<int64_t>(2 * manFiles) || mtimeSkew < 0 || mtimeSkew > 600 ||
+        first.files != manFiles || again.files != 0 || again.skipped != manFiles || touched.files != 0 ||
+        touched.skipped != manFiles || touchedMtime < now + 3000 || changed.files != 1 ||
+        changed.skipped != manFiles - 1 || hashAfter == hashBefore || rowsAfter != manRows) {
+        std::cerr << "manifest check failed, files: " << first.files << "/" << again.files << "/" << touched.files
+                  << "/" << changed.files << " skew: " << mtimeSkew << "\n";
+        return 22;
+    }
+
+    // A segment flush that fails rolls back the commit recording the file,
+    // so the next run parses it again instead of skipping it.
+    fs::path segFailDir = fs::temp_directory_path() / "eniq_test_segment_fail";
+    fs::remove_all(segFailDir);
+    fs::create_directories(segFailDir);
+    const fs::path segFailDb = segFailDir / "pm.db";
+    const fs::path segFailSegs = segFailDir / "segs";
+    std::ofstream(segFailSegs) << "not a directory";
+    std::ofstream(segFailDir / "a.xml", std::ios::binary) << testXml;
+    IngestOptions segFailIngest;
+    segFailIngest.quiet = true;
+    SegmentWriter segFailWriter(segFailSegs.string());
+    DbOptions segFailOpts;
+    segFailOpts.quiet = true;
+    segFailOpts.insertedOnly = true;
+    {
+        DbWriter db(segFailOpts);
+        ok = db.open(segFailDb.string()) &&
+             !ingestFiles({(segFailDir / "a.xml").string()}, db, segFailIngest, &segFailWriter);
+    }
+    const int64_t segFailRows = queryInt(segFailDb, "SELECT count(*) FROM pm_counters;");
+    const int64_t segFailFiles = queryInt(segFailDb, "SELECT count(*) FROM ingest_manifest;");
+    fs::remove(segFailSegs);
+    {
+        DbWriter db(segFailOpts);
+        ok = ok && db.open(segFailDb.string()) &&
+             ingestFiles({(segFailDir / "a.xml").string()}, db, segFailIngest, &segFailWriter);
+    }
+    const Aggregate segRetry = scanSegments(segFailSegs.string(), ScanFilter());
+    const int64_t retryFiles = queryInt(segFailDb, "SELECT count(*) FROM ingest_manifest;");
+    fs::remove_all(segFailDir);
+    if (!ok || segFailRows != 0 || segFailFiles != 0 || retryFiles != 1 || segRetry.count != 2) {
+        std::cerr << "failed segment flush was committed, rows: " << segFailRows << " files: " << segFailFiles
+                  << " segments: " << segRetry.count << "\n";
+        return 23;
+    }
+
+    // Generated files must parse back to exactly what the generator wrote.
+    fs::path genDir = fs::temp_directory_path() / "eniq_test_gen";
+    PmGenOptions gen;
+    gen.files = 2;
+    gen.nodes = 1;
+    gen.measInfos = 3;
+    gen.mos = 40;
+    gen.counters = 12;
+    gen.dupRatio = 0.25;
+    PmGenStats genStats;
+    std::vector<std::string> genFiles = generatePmFiles(genDir.string(), gen, genStats);
+    RecordBatch generated;
+    size_t genDropped = 0;
+    ok = genFiles.size() == 2;
+    for (const auto& f : genFiles) {
+        generated.clear();
+        ok = ok && parse_ericsson_pm_xml(f, generated);
+        genDropped += generated.dedupe();
+    }
+    std::string lastTs = ok ? std::string(generated.strings.view(generated.records[0].timestamp)) : "";
+    fs::remove_all(genDir);
+    if (!ok || genStats.duplicates == 0 || genDropped != genStats.duplicates ||
+        generated.records.size() != 3 * 40 * 12 || lastTs != "2026-01-01T00:15:00Z") {
+        std::cerr << "generator round trip failed, dropped: " << genDropped << " of " << genStats.duplicates << "\n";
+        return 13;
+    }
+
+    // Generator options take whole, in-range numbers only.
+    auto genOptionBad = [](const char* name, const char* value) {
+        char* args[] = {const_cast<char*>("pm_gen"), const_cast<char*>(name), const_cast<char*>(value)};
+        PmGenOptions o;
+        int i = 1;
+        bool bad = false;
+        return parseGenOption(3, args, i, o, bad) && bad;
+    };
+    if (genOptionBad("--files", "10") || !genOptionBad("--files", "-1") || !genOptionBad("--files", "10x") ||
+        !genOptionBad("--seed", "4294967296") || !genOptionBad("--dup-ratio", "nan") ||
+        !genOptionBad("--rop-minutes", "0")) {
+        std::cerr << "generator option parsing accepts bad values\n";
+        return 24;
+    }
+
+    // Per-file metrics add up in the Prometheus export; queued JSON file
+    // lines are written ahead of the final totals.
+    fs::path promPath = fs::temp_directory_path() / "eniq_test_metrics.prom";
+    fs::path jsonPath = fs::temp_directory_path() / "eniq_test_metrics.json";
+    fs::remove(jsonPath);
+    {
+        IngestMetrics metrics;
+        metrics.exportPrometheus(promPath.string());
+        ok = metrics.exportJson(jsonPath.string());
+        IngestCounters file;
+        file[Stage::Parse] = 0.25;
+        file.files = 1;
+        file.records = 10;
+        file.duplicates = 2;
+        metrics.addFile("a.xml", file);
+        metrics.addFile("b.xml", file);
+        file = IngestCounters();
+        file.errors = 1;
+        metrics.add(file);
+    }
+    std::string prom, json;
+    {
+        std::ifstream in(promPath);
+        prom.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        std::ifstream jsonIn(jsonPath);
+        json.assign(std::istreambuf_iterator<char>(jsonIn), std::istreambuf_iterator<char>());
+    }
+    fs::remove(promPath);
+    fs::remove(jsonPath);
+    const size_t lastFile = json.find("\"file\":\"b.xml\"");
+    const size_t total = json.find("\"type\":\"total\"");
+    if (!ok || json.find("\"file\":\"a.xml\"") == std::string::npos || lastFile == std::string::npos ||
+        total == std::string::npos || total < lastFile ||
+        prom.find("eniq_stage_seconds_total{stage=\"parse\"} 0.500000\n") == std::string::npos ||
+        prom.find("eniq_records_total 20\n") == std::string::npos ||
+        prom.find("eniq_duplicates_total 4\n") == std::string::npos ||
+        prom.find("eniq_errors_total 1\n") == std::string::npos) {
+        std::cerr << "metrics export failed:\n" << prom << json;
+        return 14;
+    }
+
+#ifdef ENIQ_HAVE_ZLIB
+    // Two gzip members back to back, as `cat a.gz b.gz` produces.
+    fs::path gzPath = fs::temp_directory_path() / "eniq_test_tricky.xml.gz";
+    {
+        std::string xml = kTrickyXml;
+        size_t half = xml.size() / 2;
+        gzFile gz = gzopen(gzPath.string().c_str(), "wb");
+        gzwrite(gz, xml.data(), static_cast<unsigned>(half));
+        gzclose(gz);
+        gz = gzopen(gzPath.string().c_str(), "ab");
+        gzwrite(gz, xml.data() + half, static_cast<unsigned>(xml.size() - half));
+        gzclose(gz);
+    }
+    std::vector<CounterRecord> unzipped;
+    ok = parse_ericsson_pm_xml(gzPath.string(), unzipped);
+    fs::remove(gzPath);
+    if (!ok || unzipped.size() != 3 || unzipped[2].counter_name != "pmC" || unzipped[1].value != 25.0) {
+        std::cerr << "gzip parse failed, records: " << unzipped.size() << "\n";
+        return 10;
+    }
+#endif
+
+    int64_t epoch = 0;
+    if (!parsePmTimestamp(streamed[0].timestamp, epoch) || epoch != 1770678900 ||
+        formatPmTimestamp(epoch) != "2026-02-09T23:15:00Z" || !parsePmTimestamp("2026-02-10 00:00:00.5", epoch) ||
+        epoch != 1770681600 || parsePmTimestamp("2026-02-10T00:00:00+1", epoch)) {
+        std::cerr << "timestamp conversion failed\n";
+        return 8;
+    }
+
     std::cout << "OK\n";
     return 0;
 }